@@ -6,14 +6,22 @@
  *
  * NOTES:
  *  - Explicit allocator with an explicit free-list
- *  - Free-list uses a single, doubly-linked list with LIFO insertion policy,
- *    first-fit search strategy, and immediate coalescing.
+ *  - Free blocks are kept in segregated, doubly-linked free-lists (one per
+ *    size class) with LIFO insertion policy, first-fit search strategy
+ *    starting at the smallest class that can satisfy the request, and
+ *    immediate coalescing (deferred for small blocks, see FAST BINS). Blocks
+ *    of TREE_MIN_SIZE bytes or more are kept in a size-ordered splay tree
+ *    instead, searched best-fit.
+ *  - Alternatively (FIT_POLICY == FIT_TLSF), the size classes are indexed as
+ *    a two-level segregated fit with bitmaps, giving O(1) malloc and free.
  *  - We use "next" and "previous" to refer to blocks as ordered in the free-list.
  *  - We use "following" and "preceding" to refer to adjacent blocks in memory.
  *  - Pointers in the free-list will point to the beginning of a heap block
  *    (i.e., to the header).
  *  - Pointers returned by mm_malloc point to the beginning of the payload
  *    (i.e., to the word after the header).
+ *  - Everything beyond mm.h's mm_init, mm_malloc and mm_free is declared in
+ *    mm_ext.h.
  *
  * ALLOCATOR BLOCKS:
  *  - See definition of block_info struct fields further down
@@ -42,15 +50,140 @@
  *  - TAG_PRECEDING_USED is bit 1 (the 2's digit) and indicates if the
  *    preceding heap block is used/allocated. Used for coalescing and avoids
  *    the need for a footer in used/allocated blocks.
+ *  - TAG_ZEROED is bit 2 (the 4's digit) and, on a free block, indicates that
+ *    every word of the block other than its header, next/prev ptrs and footer
+ *    is known to be zero. Used by mm_calloc to skip clearing fresh memory.
+ *  - TAG_MMAPPED is the same bit on a used block and indicates the block is
+ *    not in the heap but in a mapping of its own (see MMAP CHUNKS below).
+ *  - Built with COMPACT_HEAP, headers and footers are 32 bits instead of a
+ *    word and the next/prev ptrs are 32-bit offsets from the start of the
+ *    heap, so on 64-bit machines the smallest block is 16 bytes, not 32.
+ *    Block payloads stay ALIGNMENT-aligned, so headers sit 4 bytes off.
+ *
+ * MMAP CHUNKS:
+ *  - Requests of at least mmap_threshold bytes get their own mmap region,
+ *    which is unmapped again when they are freed.
+ *  - The chunk's header sits in the first page of the mapping (at its start
+ *    unless the chunk was allocated with extra alignment) and its SIZE is the
+ *    length of the mapping measured from that page.
+ *  - Freeing a chunk larger than the threshold raises the threshold to its
+ *    size (up to MMAP_THRESHOLD_MAX), so sizes that are repeatedly allocated
+ *    and freed move into the heap instead of paying for mmap/munmap.
+ *
+ * FAST BINS:
+ *  - A freed block of up to FASTBIN_MAX_SIZE bytes isn't coalesced but filed,
+ *    still marked used, in its arena's fast bin for exactly its size (singly
+ *    linked through its payload, LIFO). The next request of that size takes
+ *    it back as is, so an alloc/free pair costs no coalescing or splitting.
+ *  - The fast bins are consolidated, freeing and coalescing all their blocks
+ *    in one pass, when a request finds no free block big enough or when they
+ *    hold more than FASTBIN_MAX_BYTES.
+ *
+ * PURGING:
+ *  - Free blocks of at least PURGE_MIN_SIZE bytes keep a "dirty stamp" in the
+ *    word after their next/prev ptrs: the time (see now_ms) they last held
+ *    data, or 0 if their pages are known to be clean.
+ *  - Once a block has been dirty for purge_decay_ms, its page-aligned
+ *    interior (everything but the header, next/prev ptrs, stamp and footer)
+ *    is released with madvise, so recently freed memory stays hot and idle
+ *    memory goes back to the OS.
+ *
+ * THREADS:
+ *  - Memory is divided among arenas, each a heap of its own with its own free
+ *    index and lock. The main arena is memlib's heap; the others live in
+ *    ARENA_REGION_SIZE-aligned regions reserved with mmap, so the arena that
+ *    owns a block can be told from the block's address (see arena_of).
+ *  - The heap_* functions work on locked_arena, the arena whose lock the
+ *    calling thread holds; the mm_* functions take the lock. Frees always go
+ *    back to the arena that owns the block.
+ *  - A thread freeing a block that another arena owns doesn't take that
+ *    arena's lock, but pushes the block onto the arena's remote-free queue
+ *    with a single CAS. Whoever next locks the arena to allocate frees the
+ *    whole queue at once.
+ *  - Threads are assigned arenas round-robin, and a thread that keeps finding
+ *    its arena's lock taken moves to the least loaded arena.
+ *  - In front of the arenas, each thread keeps a cache of used blocks of up to
+ *    TCACHE_MAX_SIZE bytes in exact-size bins (singly linked through their
+ *    payloads), so most small mallocs and frees never take the lock. Bins are
+ *    refilled and flushed in batches, and a thread's cache goes back to the
+ *    heap when the thread exits.
+ *  - Built with PERCPU_CACHE, the same bins are kept per CPU instead of per
+ *    thread where the kernel supports restartable sequences (rseq), so cache
+ *    memory grows with the number of CPUs rather than threads. A push or pop
+ *    is a short sequence that the kernel restarts if the thread is preempted
+ *    or migrated part way, so it needs no atomics.
+ *
+ * HEAPS:
+ *  - mm_heap_create gives a subsystem a private heap (an mm_heap_t): an arena
+ *    that threads are never assigned to, with its own region, free index,
+ *    fast bins and counters. mm_heap_malloc and mm_heap_free work on it under
+ *    its lock, bypassing the caches, slabs and mmap chunks, so all of its
+ *    memory lies in its region and mm_heap_destroy drops it in one munmap.
+ *  - A private heap's blocks must be freed with mm_heap_free on that heap.
+ *    A NULL mm_heap_t stands for the default heap used by mm_malloc.
+ *  - A private heap can't grow past its ARENA_REGION_SIZE region (less the
+ *    heap-header): mm_heap_malloc returns NULL instead of falling back to
+ *    mmap chunks, which mm_heap_destroy would not release.
+ *  - mm_heap_get_stats reports on one private heap alone.
+ *
+ * REGIONS:
+ *  - A region (an mm_arena_t, not to be confused with the arenas above)
+ *    bump-allocates objects out of chunks it gets from mm_malloc, and frees
+ *    them all at once: mm_arena_reset gives every chunk but the newest back
+ *    with mm_free_batch, and mm_arena_destroy gives back all of them.
+ *  - Objects are not freed one by one, and a region is not thread-safe.
+ *
+ * POOLS:
+ *  - A pool (an mm_pool_t) hands out objects of one size and alignment from
+ *    chunks it gets from mm_memalign. Chunks are aligned to their size, so an
+ *    object's chunk is found by masking its address, and each keeps a stack
+ *    of its free objects linked through their first word, and a count of
+ *    those in use.
+ *  - Pools grow a chunk at a time. Chunks that become empty are kept until
+ *    mm_pool_trim gives them back to the heap.
+ *
+ * STATISTICS:
+ *  - mm_get_stats reports on everything but private heaps, which have
+ *    mm_heap_get_stats instead. Its counters are
+ *    kept off the fast paths: each arena counts its splits, coalesces, sbrk
+ *    calls and used bytes under its own lock, and each thread counts its
+ *    mallocs and frees in its cache. Both are added to relaxed atomic totals
+ *    in batches, so the peak of the bytes in use may be missed by up to
+ *    STATS_PUBLISH_BYTES per arena.
+ *  - Bytes in use count whole blocks (headers and slack included) and
+ *    include blocks waiting in the caches and fast bins; slab memory is
+ *    counted by the page. Free blocks are counted by walking the heaps when
+ *    mm_get_stats is called.
+ *
+ * SLABS:
+ *  - Requests of up to SLAB_MAX_SIZE bytes are not served from the heap but
+ *    from slabs: SLAB_PAGE_SIZE pages of equal slots, one slot size per
+ *    multiple of ALIGNMENT. Slots carry no header; the slot size and a bitmap
+ *    of free slots are kept once per page, in a header at its start.
+ *  - Slab pages live in a region of their own reserved with mmap, so a slab
+ *    object is told apart from a heap block by its address alone.
+ *  - Each slot size has a lock and a list of the pages with free slots.
+ *    Threads cache slab objects in bins of their own, as for small heap
+ *    blocks (also when built with PERCPU_CACHE), and pages that become empty
+ *    go back to a pool shared by all slot sizes.
  */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <assert.h>
 #include <unistd.h>
+#include <stdint.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <pthread.h>
+#include <stddef.h>
 
 #include "memlib.h"
 #include "mm.h"
+#include "mm_ext.h"
 #include <stdbool.h>
 
 // Static functions for unscaled pointer arithmetic to keep other code cleaner.
@@ -60,40 +193,150 @@
 //  - We cast the result to void* to force you to cast back to the appropriate
 //    type and ensure you don't accidentally use the resulting pointer as a
 //    char* implicitly.
-static inline void* UNSCALED_POINTER_ADD(void* p, int x) { return ((void*)((char*)(p) + (x))); }
-static inline void* UNSCALED_POINTER_SUB(void* p, int x) { return ((void*)((char*)(p) - (x))); }
+//  - The offset is a ptrdiff_t, not an int, as coalesced free blocks can
+//    reach 2 GiB in a big heap (a compact heap may span up to 4 GiB).
+static inline void* UNSCALED_POINTER_ADD(void* p, ptrdiff_t x) { return ((void*)((char*)(p) + (x))); }
+static inline void* UNSCALED_POINTER_SUB(void* p, ptrdiff_t x) { return ((void*)((char*)(p) - (x))); }
+
 
+// Compact heaps (COMPACT_HEAP=1, e.g. -DCOMPACT_HEAP=1): boundary tags are
+// 32 bits wide and free-list links are 32-bit offsets from heap_lo(), which
+// halves MIN_BLOCK_SIZE on 64-bit machines. Every heap must stay below 4 GiB,
+// which heap_sbrk enforces; past that, requests fall back to mmap chunks.
+#ifndef COMPACT_HEAP
+#define COMPACT_HEAP 0
+#endif
+
+// A boundary tag (size and tags), and a link to a block in the free index:
+// a pointer, or for compact heaps an offset from heap_lo() (see from_link
+// and to_link).
+#if COMPACT_HEAP
+typedef uint32_t tag_t;
+typedef uint32_t block_link;
+#else
+typedef size_t tag_t;
+typedef struct block_info* block_link;
+#endif
 
 // A block_info can be used to access information about a heap block,
 // including boundary tag info (size and usage tags in header and footer)
-// and pointers to the next and previous blocks in the free-list.
+// and links to the next and previous blocks in the free-list.
 struct block_info {
     // Size of the block and tags (preceding-used? and used? flags) combined
 	// together. See the SIZE() function and TAG macros below for more details
 	// and how to extract these pieces of info.
-    size_t size_and_tags;
-    // Pointer to the next block in the free list.
-    struct block_info* next;
-    // Pointer to the previous block in the free list.
-    struct block_info* prev;
+    tag_t size_and_tags;
+    // Link to the next block in the free list, or the left child for
+    // blocks in the best-fit tree.
+    union {
+        block_link next;
+        block_link left;
+    };
+    // Link to the previous block in the free list, or the right child for
+    // blocks in the best-fit tree.
+    union {
+        block_link prev;
+        block_link right;
+    };
 };
 typedef struct block_info block_info;
 
 
-// Pointer to the first block_info in the free list, the list's head.
-// In this implementation, this is stored in the first word in the heap and
-// accessed via mem_heap_lo().
-#define FREE_LIST_HEAD *((block_info **)mem_heap_lo())
-
 // Size of a word on this architecture.
 #define WORD_SIZE sizeof(void*)
 
-// Minimum block size (accounts for header, next ptr, prev ptr, and footer).
-#define MIN_BLOCK_SIZE (sizeof(block_info) + WORD_SIZE)
+// Size of a boundary tag: a block's header or footer, or the end-of-heap
+// word. A word, unless the heap is compact.
+#define TAG_SIZE sizeof(tag_t)
+
+// Free-block indexing policies, selected at compile time with FIT_POLICY
+// (e.g., -DFIT_POLICY=FIT_TLSF) so both can be run on the same traces.
+//  - FIT_SEGREGATED: segregated free lists searched first-fit.
+//  - FIT_TLSF: two-level segregated fit; bitmaps over the size classes make
+//    both the search and insert/remove constant time.
+#define FIT_SEGREGATED 0
+#define FIT_TLSF 1
+#ifndef FIT_POLICY
+#define FIT_POLICY FIT_SEGREGATED
+#endif
+
+#if FIT_POLICY == FIT_TLSF
+// TLSF size classes. The first level splits sizes by power of two and the
+// second level splits each power of two into TLSF_SL_COUNT equal ranges.
+// Sizes below TLSF_SMALL_BLOCK_SIZE all share first-level index 0 and are
+// split linearly, ALIGNMENT bytes per class.
+#define TLSF_SL_COUNT_LOG2 4
+#define TLSF_SL_COUNT (1 << TLSF_SL_COUNT_LOG2)
+#define TLSF_FL_SHIFT (TLSF_SL_COUNT_LOG2 + 3)
+#define TLSF_SMALL_BLOCK_SIZE ((size_t) 1 << TLSF_FL_SHIFT)
+// Blocks of 2^(TLSF_FL_MAX + 1) bytes or more all share the last class.
+// First-level index 0 holds the small blocks, so the power-of-two ranges
+// 2^TLSF_FL_SHIFT through 2^TLSF_FL_MAX get indices 1 and up.
+#define TLSF_FL_MAX 32
+#define TLSF_FL_COUNT (TLSF_FL_MAX - TLSF_FL_SHIFT + 2)
+#define NUM_SIZE_CLASSES (TLSF_FL_COUNT * TLSF_SL_COUNT)
+
+// The free-list heads plus the bitmaps that record which lists are
+// non-empty: bit 'fl' of fl_bitmap is set iff sl_bitmap[fl] != 0, and bit
+// 'sl' of sl_bitmap[fl] is set iff the list for (fl, sl) is non-empty.
+struct free_index {
+  size_t fl_bitmap;
+  uint32_t sl_bitmap[TLSF_FL_COUNT];
+  block_info* heads[NUM_SIZE_CLASSES];
+};
+#else
+// Number of segregated free lists (size classes).
+//  - Classes below SMALL_CLASS_LIMIT are 16 bytes wide, so a small request
+//    only ever looks at blocks within 8 bytes of its own size.
+//  - Classes from SMALL_CLASS_LIMIT up to TREE_MIN_SIZE are powers of two.
+//  - Blocks of TREE_MIN_SIZE bytes or more are not kept in a list but in a
+//    best-fit tree, filed under the pseudo-class TREE_CLASS.
+#define SMALL_CLASS_LIMIT 256
+#define SMALL_CLASS_SHIFT 4
+#define NUM_SMALL_CLASSES (SMALL_CLASS_LIMIT >> SMALL_CLASS_SHIFT)
+#define SMALL_CLASS_LIMIT_LOG2 8
+#define TREE_MIN_SIZE 1024
+#define TREE_MIN_SIZE_LOG2 10
+#define NUM_SIZE_CLASSES (NUM_SMALL_CLASSES + TREE_MIN_SIZE_LOG2 - SMALL_CLASS_LIMIT_LOG2)
+#define TREE_CLASS NUM_SIZE_CLASSES
+
+// The free-list heads plus the root of the best-fit tree. The tree is a
+// splay tree ordered by (size, address) whose nodes are the free blocks
+// themselves, using the 'left' and 'right' words in place of next/prev.
+struct free_index {
+  block_info* heads[NUM_SIZE_CLASSES];
+  block_info* tree_root;
+};
+#endif
+
+// The free-list heads (and any index metadata) live in the heap-header at
+// the start of the heap and are accessed via heap_lo().
+#define FREE_INDEX ((struct free_index *)heap_lo())
+
+// Pointer to the first block_info in the free list for size class 'class',
+// the list's head.
+#define FREE_LIST_HEAD(class) (FREE_INDEX->heads[class])
+
+// Size of the heap-header holding the free index, rounded so that the
+// payload of the first block (after its TAG_SIZE header) is aligned.
+#define HEAP_HEADER_SIZE \
+  ((sizeof(struct free_index) + TAG_SIZE + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT - TAG_SIZE)
+
+// Minimum block size (accounts for header, next link, prev link, and footer).
+#define MIN_BLOCK_SIZE (sizeof(block_info) + TAG_SIZE)
 
 // Alignment requirement for allocator.
 #define ALIGNMENT 8
 
+// Largest request served. Keeps block size calculations from overflowing, and
+// for compact heaps leaves room for page rounding and alignment padding below
+// the 4 GiB a boundary tag can hold.
+#if COMPACT_HEAP
+#define MAX_REQUEST_SIZE ((size_t) 1 << 31)
+#else
+#define MAX_REQUEST_SIZE ((size_t) -1 / 2)
+#endif
+
 // SIZE(block_info->size_and_tags) extracts the size of a 'size_and_tags' field.
 // SIZE(size) returns a properly-aligned value of 'size' (by rounding down).
 static inline size_t SIZE(size_t x) { return ((x) & ~(ALIGNMENT - 1)); }
@@ -104,17 +347,383 @@ static inline size_t SIZE(size_t x) { return ((x) & ~(ALIGNMENT - 1)); }
 // Bit mask to use to extract or set TAG_PRECEDING_USED in a boundary tag.
 #define TAG_PRECEDING_USED 2
 
+// Bit mask to use to extract or set TAG_ZEROED in a free block's boundary tag.
+#define TAG_ZEROED 4
+
+// Bit mask to use to extract or set TAG_MMAPPED in a used block's header.
+#define TAG_MMAPPED 4
+
+// Bounds and initial value for the adaptive mmap threshold.
+#define MMAP_THRESHOLD_MIN (128 * 1024)
+#define MMAP_THRESHOLD_MAX (4 * 1024 * 1024 * sizeof(long))
+
+// Default for the automatic trim threshold: when the free block at the end of
+// the heap grows beyond trim_threshold bytes, mm_free gives all but TRIM_PAD
+// bytes of it back with a negative mem_sbrk. A memlib that refuses is only
+// asked once (see cant_shrink in struct arena).
+#define DEFAULT_TRIM_THRESHOLD (2 * MMAP_THRESHOLD_MIN)
+#define TRIM_PAD (64 * 1024)
+
+// Free blocks of at least PURGE_MIN_SIZE bytes carry a dirty stamp and may have
+// their interior pages purged once they have been dirty for purge_decay_ms.
+// The clock is only looked at every PURGE_CHECK_INTERVAL frees.
+#define PURGE_MIN_SIZE (64 * 1024)
+#define DEFAULT_PURGE_DECAY_MS 10000
+#define PURGE_CHECK_INTERVAL 1024
+
+// How purged pages are given back. MADV_DONTNEED releases them immediately;
+// MADV_FREE lets the kernel reclaim them lazily.
+#ifndef PURGE_ADVICE
+#define PURGE_ADVICE MADV_DONTNEED
+#endif
+
+// Defaults for the heap growth policy used by request_more_space. While a
+// heap can be trimmed, the maximum is also held to half the trim threshold
+// (128 KiB to start with), so the 4 MiB here applies to heaps that can't be.
+#define DEFAULT_GROWTH_MIN_CHUNK (16 * 1024)
+#define DEFAULT_GROWTH_PERCENT 25
+#define DEFAULT_GROWTH_MAX_CHUNK (4 * 1024 * 1024)
+
+// Thread caches: blocks of up to TCACHE_MAX_SIZE bytes are cached per thread
+// in one bin per block size. A bin holds up to TCACHE_BIN_CAPACITY blocks, an
+// empty bin is refilled with TCACHE_REFILL blocks at once, and a full one
+// gives TCACHE_FLUSH blocks back.
+#define TCACHE_MAX_SIZE 512
+#define TCACHE_NUM_BINS ((TCACHE_MAX_SIZE - MIN_BLOCK_SIZE) / ALIGNMENT + 1)
+#define TCACHE_BIN_CAPACITY 32
+#define TCACHE_REFILL 8
+#define TCACHE_FLUSH 16
+
+// Fast bins (see FAST BINS above): one per block size up to
+// FASTBIN_MAX_SIZE, the sizes the thread caches flush and refill.
+#define FASTBIN_MAX_SIZE TCACHE_MAX_SIZE
+#define NUM_FASTBINS TCACHE_NUM_BINS
+#define FASTBIN_MAX_BYTES (64 * 1024)
+
+// Arenas: threads are spread over ARENAS_PER_CPU arenas per online CPU, but
+// no more than MAX_ARENAS. Every arena but the main one reserves
+// ARENA_REGION_SIZE bytes of address space, which bounds how far its heap can
+// grow. A thread moves once it has found its arena's lock taken
+// ARENA_CONTENTION_LIMIT more times than free.
+#define MAX_ARENAS 64
+#define ARENAS_PER_CPU 2
+#if UINTPTR_MAX > 0xffffffff
+#define ARENA_REGION_SIZE ((size_t) 1 << 30)
+#else
+#define ARENA_REGION_SIZE ((size_t) 1 << 26)
+#endif
+#define ARENA_CONTENTION_LIMIT 16
+
+// After queueing this many blocks on other arenas, a thread drains the queue
+// it last pushed onto itself, provided that arena's lock is free.
+#define REMOTE_FREE_LIMIT 64
+
+// Per-CPU caches (see THREADS above) are only implemented for x86-64 Linux,
+// and otherwise (or if the C library doesn't register an rseq area) the
+// thread caches are used. A CPU's bin holds up to PERCPU_BIN_CAPACITY blocks
+// and is refilled and flushed with the thread cache's batch sizes.
+#ifndef PERCPU_CACHE
+#define PERCPU_CACHE 0
+#endif
+#if PERCPU_CACHE && !(defined(__x86_64__) && defined(__linux__))
+#undef PERCPU_CACHE
+#define PERCPU_CACHE 0
+#endif
+#define PERCPU_BIN_CAPACITY 32
+
+// Slabs (see SLABS above): objects of up to SLAB_MAX_SIZE bytes are kept in
+// slab pages of SLAB_PAGE_SIZE bytes, within SLAB_REGION_SIZE bytes of
+// reserved address space. Requests that don't fit once the region is used up
+// go to the heap.
+#define SLAB_MAX_SIZE 64
+#define SLAB_NUM_CLASSES (SLAB_MAX_SIZE / ALIGNMENT)
+#define SLAB_PAGE_SIZE 4096
+#define SLAB_BITMAP_WORDS ((SLAB_PAGE_SIZE / ALIGNMENT + 63) / 64)
+#if UINTPTR_MAX > 0xffffffff
+#define SLAB_REGION_SIZE ((size_t) 1 << 28)
+#else
+#define SLAB_REGION_SIZE ((size_t) 1 << 24)
+#endif
+#define SLAB_NUM_PAGES (SLAB_REGION_SIZE / SLAB_PAGE_SIZE)
+
+// Regions (see REGIONS above) bump-allocate out of chunks of at least
+// REGION_CHUNK_SIZE bytes, and give them back REGION_FREE_BATCH at a time.
+#define REGION_CHUNK_SIZE (64 * 1024)
+#define REGION_FREE_BATCH 64
+
+// Pools (see POOLS above) carve objects out of chunks of POOL_CHUNK_SIZE
+// bytes, or of the smallest larger power of two that holds at least
+// POOL_MIN_OBJECTS objects.
+#define POOL_CHUNK_SIZE (64 * 1024)
+#define POOL_MIN_OBJECTS 16
+
+// Statistics (see STATISTICS above): an arena adds its used bytes to the
+// allocator-wide count once they have changed by STATS_PUBLISH_BYTES, and a
+// thread adds its malloc and free counts once they reach
+// STATS_FLUSH_INTERVAL.
+#define STATS_PUBLISH_BYTES (64 * 1024)
+#define STATS_FLUSH_INTERVAL 256
+
+// Set to 1 if memory that mem_sbrk hands out for the first time reads as zero
+// (memlib's heap is an anonymous mapping), so fresh heap space needs no
+// clearing in mm_calloc.
+#ifndef SBRK_MEMORY_IS_ZERO
+#define SBRK_MEMORY_IS_ZERO 1
+#endif
+
+// An arena: a heap with its own free index (in the heap-header at 'lo') and
+// its own lock. See THREADS above. A private heap (an mm_heap_t, see HEAPS
+// above) is an arena of its own.
+struct arena {
+  pthread_mutex_t lock;
+  // First byte of the heap and the arena's break (one past its last byte).
+  void* lo;
+  void* brk;
+  // End of the region reserved for the arena, or NULL for the main arena,
+  // which grows with mem_sbrk.
+  void* limit;
+  // Highest break the heap has ever had. Memory above it has never been
+  // handed out, so with SBRK_MEMORY_IS_ZERO it is still zero. It is
+  // deliberately not reset by mm_init, which reuses the old heap memory.
+  void* high_water;
+  // Set once mem_sbrk has refused to shrink the main arena's heap. The stock
+  // memlib can't shrink and prints an error each time it is asked to, so it
+  // is not asked again.
+  bool cant_shrink;
+  // Number of threads assigned to the arena. Protected by arenas_lock.
+  unsigned int threads;
+  // Payloads of used blocks freed by threads of other arenas and not yet
+  // returned to the heap, linked through the first payload word. Pushed
+  // onto without the lock; see arena_remote_free.
+  void* remote_frees;
+  // Fast bins: see FAST BINS above. Each holds used blocks of one size,
+  // linked through the first payload word; 'fastbin_bytes' is their total.
+  void* fastbins[NUM_FASTBINS];
+  size_t fastbin_bytes;
+  // Purge state: see PURGING above.
+  size_t last_purge_sweep;
+  size_t frees_since_purge_check;
+  size_t purged_bytes;
+  // Number of mm_realloc calls that resized a block, and how many of those
+  // were satisfied without moving it. See mm_realloc_counts().
+  size_t realloc_count;
+  size_t realloc_in_place_count;
+  // Statistics: see STATISTICS above. 'in_use_bytes' is the size of all used
+  // blocks, of which 'published_bytes' has been added to stats_in_use_bytes;
+  // 'peak_bytes' is its highest value.
+  size_t in_use_bytes;
+  size_t published_bytes;
+  size_t peak_bytes;
+  size_t split_count;
+  size_t coalesce_count;
+  size_t sbrk_count;
+  // Set for private heaps, which are left out of the allocator-wide
+  // statistics and count their own mm_heap_malloc and mm_heap_free calls.
+  bool is_private;
+  size_t malloc_count;
+  size_t free_count;
+};
+
+// The header at the start of a region's chunk, which the region's objects
+// follow.
+struct region_chunk {
+  struct region_chunk* next;
+  size_t size;
+};
+#define REGION_HEADER_SIZE \
+  ((sizeof(struct region_chunk) + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT)
+
+// A region (see REGIONS above): its chunks, newest first, and the part of
+// the newest one that is still free.
+struct region {
+  struct region_chunk* chunks;
+  char* cur;
+  char* end;
+};
+
+// The header at the start of a pool's chunk. 'free' is a stack of the freed
+// objects, linked through their first word, and objects from 'unused' on
+// have never been handed out.
+struct pool_chunk {
+  struct pool_chunk* next;
+  struct pool_chunk* prev;
+  void* free;
+  char* unused;
+  size_t live;
+};
+
+// A pool (see POOLS above). Each chunk is on one of two lists, depending on
+// whether it has room for another object.
+struct pool {
+  size_t obj_size;
+  size_t chunk_size;
+  // Offset of the first object in a chunk, and how many objects a chunk holds.
+  size_t first_offset;
+  size_t chunk_objects;
+  struct pool_chunk* partial;
+  struct pool_chunk* full;
+};
+
+// The arena the heap_* functions work on: the one whose lock this thread
+// holds.
+static __thread struct arena* locked_arena;
+
+// Every arena, main_arena first. Entries are only added, under arenas_lock,
+// and num_arenas is published after the new entry is written, so arena_of
+// can read the array without the lock.
+static struct arena main_arena = { .lock = PTHREAD_MUTEX_INITIALIZER };
+static struct arena* arenas[MAX_ARENAS] = { &main_arena };
+static unsigned int num_arenas = 1;
+
+#if PERCPU_CACHE
+// One bin of a CPU's cache. Blocks are kept in an array rather than linked
+// through their payloads, so that a push or pop commits with a single store
+// to 'count'.
+struct percpu_bin {
+  size_t count;
+  void *slots[PERCPU_BIN_CAPACITY];
+};
+
+struct percpu_cache {
+  struct percpu_bin bins[TCACHE_NUM_BINS];
+};
+
+// One cache for each of percpu_count CPUs, or NULL if they couldn't be
+// mapped.
+static struct percpu_cache *percpu_caches;
+static long percpu_count;
+static pthread_once_t percpu_once = PTHREAD_ONCE_INIT;
+#endif
+
+// The header at the start of a slab page. Slots follow it, from
+// SLAB_HEADER_SIZE bytes into the page.
+struct slab_page {
+  // Neighbours in the list of pages of this slot size that have free slots.
+  struct slab_page* next;
+  struct slab_page* prev;
+  // Slot size, number of slots, and how many of them are free.
+  unsigned short size;
+  unsigned short slots;
+  unsigned short free;
+  // Bit i is set iff slot i is free.
+  uint64_t bitmap[SLAB_BITMAP_WORDS];
+};
+
+#define SLAB_HEADER_SIZE \
+  ((sizeof(struct slab_page) + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT)
+
+// The pages of one slot size with at least one free slot, protected by
+// 'lock'.
+struct slab_class {
+  pthread_mutex_t lock;
+  struct slab_page* pages;
+};
+
+// The slab region, or NULLs if it couldn't be reserved. Pages below
+// slab_brk have been handed out before; those of them that are empty now are
+// marked in slab_free_pages. Both are protected by slab_lock.
+static char* slab_base;
+static char* slab_end;
+static char* slab_brk;
+static uint64_t slab_free_pages[SLAB_NUM_PAGES / 64];
+static pthread_mutex_t slab_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct slab_class slab_classes[SLAB_NUM_CLASSES];
+
+// Bounds of locked_arena's heap, in the same form as memlib's.
+static inline void* heap_lo() { return locked_arena->lo; }
+static inline void* heap_hi() { return UNSCALED_POINTER_SUB(locked_arena->brk, 1); }
+static inline size_t heap_size() {
+  return (char*) locked_arena->brk - (char*) locked_arena->lo;
+}
+
+// Convert between a link in the free index and the block it refers to (or
+// NULL). A compact heap's links are offsets from heap_lo(), where the
+// heap-header is, so offset 0 is free to mean no block.
+static inline block_info* from_link(block_link link) {
+#if COMPACT_HEAP
+  return link == 0 ? NULL : (block_info*) ((char*) heap_lo() + link);
+#else
+  return link;
+#endif
+}
+
+static inline block_link to_link(block_info* block) {
+#if COMPACT_HEAP
+  return block == NULL ? 0 : (block_link) ((char*) block - (char*) heap_lo());
+#else
+  return block;
+#endif
+}
+
+// floor(log2(x)) for x > 0.
+static inline int log2_floor(size_t x) {
+  return (int) (sizeof(size_t) * 8 - 1) - __builtin_clzl(x);
+}
+
+#if FIT_POLICY == FIT_TLSF
+// Returns the (flattened first-level, second-level) index of the free list
+// that holds blocks of 'size' bytes.
+static inline int size_class(size_t size) {
+  if (size < TLSF_SMALL_BLOCK_SIZE) {
+    return size / (TLSF_SMALL_BLOCK_SIZE / TLSF_SL_COUNT);
+  }
+  int fl = log2_floor(size);
+  if (fl > TLSF_FL_MAX) {
+    return NUM_SIZE_CLASSES - 1;
+  }
+  int sl = (int) (size >> (fl - TLSF_SL_COUNT_LOG2)) ^ TLSF_SL_COUNT;
+  return (fl - TLSF_FL_SHIFT + 1) * TLSF_SL_COUNT + sl;
+}
+#else
+// Returns the index of the free list that holds blocks of 'size' bytes, or
+// TREE_CLASS if blocks of that size are kept in the best-fit tree.
+static inline int size_class(size_t size) {
+  if (size < SMALL_CLASS_LIMIT) {
+    return size >> SMALL_CLASS_SHIFT;
+  }
+  if (size >= TREE_MIN_SIZE) {
+    return TREE_CLASS;
+  }
+  // floor(log2(size)), counted from SMALL_CLASS_LIMIT.
+  return NUM_SMALL_CLASSES + log2_floor(size) - SMALL_CLASS_LIMIT_LOG2;
+}
+#endif
+
+// Writes the header and footer of the free block at ptr. Used blocks have
+// no footer (see putTags).
 void putSizeAndTags(void *ptr, size_t size_and_tags){
     block_info *blockInfo = (block_info*)ptr;
+    assert(!(size_and_tags & TAG_USED));
 
     // Assign the size and tags to the block
     blockInfo->size_and_tags = size_and_tags;
 
     // Compute the location of the boundary tag.
-    void *boundaryTagLocation = UNSCALED_POINTER_ADD(blockInfo, SIZE(blockInfo->size_and_tags) - WORD_SIZE);
+    void *boundaryTagLocation = UNSCALED_POINTER_ADD(blockInfo, SIZE(blockInfo->size_and_tags) - TAG_SIZE);
 
     // Set the boundary tag.
-    *(size_t *)boundaryTagLocation = size_and_tags; 
+    *(tag_t *)boundaryTagLocation = size_and_tags; 
+}
+
+// Updates the tags of a block. Only free blocks have a boundary tag; the last
+// word of a used block (or the end-of-heap word's preceding word) belongs to
+// someone else and must not be overwritten.
+// A used block's header may be read concurrently by its owner's mm_free (see
+// THREADS above), so it is stored atomically.
+void putTags(block_info *block, size_t size_and_tags){
+    if(size_and_tags & TAG_USED){
+        __atomic_store_n(&block->size_and_tags, size_and_tags, __ATOMIC_RELAXED);
+    } else {
+        putSizeAndTags(block, size_and_tags);
+    }
+}
+
+void setTag(block_info *block, size_t tag) {
+    putTags(block, block->size_and_tags | tag);
+}
+
+void clearTag(block_info *block, size_t tag) {
+    putTags(block, block->size_and_tags & (~tag));
 }
 /*
  * Print the heap by iterating through it as an implicit free list.
@@ -126,87 +735,373 @@ static void examine_heap() {
   block_info* block;
 
   // print to stderr so output isn't buffered and not output if we crash
-  fprintf(stderr, "FREE_LIST_HEAD: %p\n", (void*) FREE_LIST_HEAD);
+  for (int class = 0; class < NUM_SIZE_CLASSES; class++) {
+    if (FREE_LIST_HEAD(class) != NULL) {
+      fprintf(stderr, "FREE_LIST_HEAD(%d): %p\n", class, (void*) FREE_LIST_HEAD(class));
+    }
+  }
+#if FIT_POLICY == FIT_SEGREGATED
+  fprintf(stderr, "TREE_ROOT: %p\n", (void*) FREE_INDEX->tree_root);
+#endif
 
-  for (block = (block_info*) UNSCALED_POINTER_ADD(mem_heap_lo(), WORD_SIZE);  // first block on heap
-       SIZE(block->size_and_tags) != 0 && block < (block_info*) mem_heap_hi();
+  for (block = (block_info*) UNSCALED_POINTER_ADD(heap_lo(), HEAP_HEADER_SIZE);  // first block on heap
+       SIZE(block->size_and_tags) != 0 && block < (block_info*) heap_hi();
        block = (block_info*) UNSCALED_POINTER_ADD(block, SIZE(block->size_and_tags))) {
 
     // print out common block attributes
-    fprintf(stderr, "%p: %ld %ld %ld\t",
+    fprintf(stderr, "%p: %ld %ld %ld %ld\t",
             (void*) block,
             SIZE(block->size_and_tags),
-            block->size_and_tags & TAG_PRECEDING_USED,
-            block->size_and_tags & TAG_USED);
+            (long) (block->size_and_tags & TAG_ZEROED),
+            (long) (block->size_and_tags & TAG_PRECEDING_USED),
+            (long) (block->size_and_tags & TAG_USED));
 
     // and allocated/free specific data
     if (block->size_and_tags & TAG_USED) {
       fprintf(stderr, "ALLOCATED\n");
     } else {
       fprintf(stderr, "FREE\tnext: %p, prev: %p\n",
-              (void*) block->next,
-              (void*) block->prev);
+              (void*) from_link(block->next),
+              (void*) from_link(block->prev));
     }
   }
   fprintf(stderr, "END OF HEAP\n\n");
 }
 
 
+#if FIT_POLICY == FIT_TLSF
+/*
+ * Find a free block of the requested size in the free lists.
+ * Returns NULL if no free block is large enough.
+ *  - The request is rounded up to the start of the next size class, so every
+ *    block in the class we land on is big enough and the head can be taken
+ *    without walking the list.
+ *  - The bitmaps give the first non-empty class at or above that one with
+ *    two find-first-set operations.
+ */
+static block_info* search_free_list(size_t req_size) {
+  struct free_index* index = FREE_INDEX;
+  int class;
+
+  if (req_size >= TLSF_SMALL_BLOCK_SIZE) {
+    req_size += ((size_t) 1 << (log2_floor(req_size) - TLSF_SL_COUNT_LOG2)) - 1;
+  }
+  if (log2_floor(req_size) > TLSF_FL_MAX) {
+    // Blocks this big share the last class, which has to be searched
+    // first-fit.
+    block_info* free_block = FREE_LIST_HEAD(NUM_SIZE_CLASSES - 1);
+    while (free_block != NULL && SIZE(free_block->size_and_tags) < req_size) {
+      free_block = from_link(free_block->next);
+    }
+    return free_block;
+  }
+  class = size_class(req_size);
+
+  int fl = class / TLSF_SL_COUNT;
+  int sl = class % TLSF_SL_COUNT;
+  uint32_t sl_map = index->sl_bitmap[fl] & (~(uint32_t) 0 << sl);
+  if (sl_map == 0) {
+    // Nothing left in this first-level range; move up to the next non-empty
+    // one and take its smallest class.
+    size_t fl_map = fl + 1 < TLSF_FL_COUNT ? index->fl_bitmap & (~(size_t) 0 << (fl + 1)) : 0;
+    if (fl_map == 0) {
+      return NULL;
+    }
+    fl = __builtin_ctzl(fl_map);
+    sl_map = index->sl_bitmap[fl];
+  }
+  sl = __builtin_ctz(sl_map);
+  return FREE_LIST_HEAD(fl * TLSF_SL_COUNT + sl);
+}
+#else
+// Returns true if the block with key (size, block) orders before 'node' in
+// the best-fit tree. Ties on size are broken by address, so every key in
+// the tree is distinct and best fit prefers lower addresses.
+static inline bool tree_key_less(size_t size, block_info* block, block_info* node) {
+  size_t node_size = SIZE(node->size_and_tags);
+  return size < node_size || (size == node_size && block < node);
+}
+
+/*
+ * Top-down splay of the tree rooted at 'root' around key (size, block).
+ * Returns the new root, which is the node with that key if there is one and
+ * otherwise its in-order predecessor or successor.
+ */
+static block_info* tree_splay(block_info* root, size_t size, block_info* block) {
+  block_info assembly;
+  block_info* left_tree_max = &assembly;
+  block_info* right_tree_min = &assembly;
+  block_info* node = root;
+
+  if (node == NULL) {
+    return NULL;
+  }
+  // 'assembly' is never linked to, only from, so its links need no offset
+  // from the heap.
+  assembly.left = to_link(NULL);
+  assembly.right = to_link(NULL);
+  while (1) {
+    if (tree_key_less(size, block, node)) {
+      if (from_link(node->left) == NULL) {
+        break;
+      }
+      if (tree_key_less(size, block, from_link(node->left))) {
+        // Zig-zig: rotate right.
+        block_info* child = from_link(node->left);
+        node->left = child->right;
+        child->right = to_link(node);
+        node = child;
+        if (from_link(node->left) == NULL) {
+          break;
+        }
+      }
+      // Link right.
+      right_tree_min->left = to_link(node);
+      right_tree_min = node;
+      node = from_link(node->left);
+    } else if (node != block) {
+      // Equality is checked by address alone, since the block being looked
+      // up may already have a new size in its header (see tree_remove).
+      block_info* right = from_link(node->right);
+      if (right == NULL) {
+        break;
+      }
+      if (!tree_key_less(size, block, right) && right != block) {
+        // Zig-zig: rotate left.
+        node->right = right->left;
+        right->left = to_link(node);
+        node = right;
+        if (from_link(node->right) == NULL) {
+          break;
+        }
+      }
+      // Link left.
+      left_tree_max->right = to_link(node);
+      left_tree_max = node;
+      node = from_link(node->right);
+    } else {
+      break;
+    }
+  }
+  // Reassemble.
+  left_tree_max->right = node->left;
+  right_tree_min->left = node->right;
+  node->left = assembly.right;
+  node->right = assembly.left;
+  return node;
+}
+
+/* Insert free_block into the best-fit tree. */
+static void tree_insert(block_info* free_block) {
+  size_t size = SIZE(free_block->size_and_tags);
+  block_info* root = tree_splay(FREE_INDEX->tree_root, size, free_block);
+
+  if (root == NULL) {
+    free_block->left = to_link(NULL);
+    free_block->right = to_link(NULL);
+  } else if (tree_key_less(size, free_block, root)) {
+    free_block->left = root->left;
+    free_block->right = to_link(root);
+    root->left = to_link(NULL);
+  } else {
+    free_block->right = root->right;
+    free_block->left = to_link(root);
+    root->right = to_link(NULL);
+  }
+  FREE_INDEX->tree_root = free_block;
+}
+
+/*
+ * Remove free_block from the best-fit tree. 'size' is the size the block
+ * was inserted with, which may differ from its header if it is being split.
+ */
+static void tree_remove(block_info* free_block, size_t size) {
+  block_info* root = tree_splay(FREE_INDEX->tree_root, size, free_block);
+
+  // Splaying on the block's own key brings it to the root.
+  if (from_link(root->left) == NULL) {
+    FREE_INDEX->tree_root = from_link(root->right);
+  } else {
+    // Everything on the left is smaller, so splaying the left subtree for
+    // this key brings its maximum up with an empty right subtree.
+    block_info* new_root = tree_splay(from_link(root->left), size, free_block);
+    new_root->right = root->right;
+    FREE_INDEX->tree_root = new_root;
+  }
+}
+
+/*
+ * Find the smallest block in the best-fit tree of at least req_size bytes,
+ * preferring the lowest address among equal sizes. Returns NULL if no block
+ * is large enough.
+ */
+static block_info* tree_search(size_t req_size) {
+  // No block has address NULL, so this key orders before every block of
+  // exactly req_size bytes.
+  block_info* root = tree_splay(FREE_INDEX->tree_root, req_size, NULL);
+
+  FREE_INDEX->tree_root = root;
+  if (root == NULL) {
+    return NULL;
+  }
+  if (SIZE(root->size_and_tags) >= req_size) {
+    return root;
+  }
+  // The root is the predecessor; the answer is the minimum of its right
+  // subtree, if there is one.
+  block_info* best = from_link(root->right);
+  if (best != NULL) {
+    while (from_link(best->left) != NULL) {
+      best = from_link(best->left);
+    }
+  }
+  return best;
+}
+
 /*
- * Find a free block of the requested size in the free list.
+ * Find a free block of the requested size in the free lists, or the best fit
+ * from the tree for requests too big for them.
  * Returns NULL if no free block is large enough.
  */
 static block_info* search_free_list(size_t req_size) {
   block_info* free_block;
+  int class = size_class(req_size);
+
+  if (class == TREE_CLASS) {
+    return tree_search(req_size);
+  }
 
-  free_block = FREE_LIST_HEAD;
+  // The request's own class may hold blocks that are slightly too small,
+  // so it has to be searched first-fit.
+  free_block = FREE_LIST_HEAD(class);
   while (free_block != NULL) {
     if (SIZE(free_block->size_and_tags) >= req_size) {
       return free_block;
     } else {
-      free_block = free_block->next;
+      free_block = from_link(free_block->next);
+    }
+  }
+
+  // Every block in a larger class is big enough, so take the first one.
+  for (class++; class < NUM_SIZE_CLASSES; class++) {
+    if (FREE_LIST_HEAD(class) != NULL) {
+      return FREE_LIST_HEAD(class);
     }
   }
-  return NULL;
+  return tree_search(req_size);
 }
+#endif
 
 
-/* Insert free_block at the head of the list (LIFO). */
+/* Insert free_block at the head of the list for its size class (LIFO). */
 static void insert_free_block(block_info* free_block) {
-  block_info* old_head = FREE_LIST_HEAD;
-  free_block->next = old_head;
+  int class = size_class(SIZE(free_block->size_and_tags));
+#if FIT_POLICY == FIT_SEGREGATED
+  if (class == TREE_CLASS) {
+    tree_insert(free_block);
+    return;
+  }
+#endif
+  block_info* old_head = FREE_LIST_HEAD(class);
+  free_block->next = to_link(old_head);
   if (old_head != NULL) {
-    old_head->prev = free_block;
+    old_head->prev = to_link(free_block);
   }
-  free_block->prev = NULL;
-  FREE_LIST_HEAD = free_block;
+  free_block->prev = to_link(NULL);
+  FREE_LIST_HEAD(class) = free_block;
+#if FIT_POLICY == FIT_TLSF
+  FREE_INDEX->fl_bitmap |= (size_t) 1 << (class / TLSF_SL_COUNT);
+  FREE_INDEX->sl_bitmap[class / TLSF_SL_COUNT] |= (uint32_t) 1 << (class % TLSF_SL_COUNT);
+#endif
 }
 
 
-/* Remove a free block from the free list. */
-static void remove_free_block(block_info* free_block) {
+/* Remove a free block from the free list of size class 'class'. */
+static void unlink_free_block(block_info* free_block, int class) {
   block_info* next_free;
   block_info* prev_free;
 
-  next_free = free_block->next;
-  prev_free = free_block->prev;
+#if FIT_POLICY == FIT_SEGREGATED
+  if (class == TREE_CLASS) {
+    tree_remove(free_block, SIZE(free_block->size_and_tags));
+    return;
+  }
+#endif
+  next_free = from_link(free_block->next);
+  prev_free = from_link(free_block->prev);
 
   // If the next block is not null, patch its prev pointer.
   if (next_free != NULL) {
-    next_free->prev = prev_free;
+    next_free->prev = free_block->prev;
   }
 
-  // If we're removingA the head of the free list, set the head to be
+  // If we're removing the head of the free list, set the head to be
   // the next block, otherwise patch the previous block's next pointer.
-  if (free_block == FREE_LIST_HEAD) {
-    FREE_LIST_HEAD = next_free;
+  if (free_block == FREE_LIST_HEAD(class)) {
+    FREE_LIST_HEAD(class) = next_free;
+#if FIT_POLICY == FIT_TLSF
+    // Keep the bitmaps in sync when the list becomes empty.
+    if (next_free == NULL) {
+      int fl = class / TLSF_SL_COUNT;
+      FREE_INDEX->sl_bitmap[fl] &= ~((uint32_t) 1 << (class % TLSF_SL_COUNT));
+      if (FREE_INDEX->sl_bitmap[fl] == 0) {
+        FREE_INDEX->fl_bitmap &= ~((size_t) 1 << fl);
+      }
+    }
+#endif
   } else {
-    prev_free->next = next_free;
+    prev_free->next = free_block->next;
+  }
+}
+
+
+/* Remove a free block from the free list. */
+static void remove_free_block(block_info* free_block) {
+  unlink_free_block(free_block, size_class(SIZE(free_block->size_and_tags)));
+}
+
+
+// Milliseconds on a coarse monotonic clock, offset so that it is never 0 (a
+// dirty stamp of 0 means clean).
+static size_t now_ms() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+  return (size_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000 + 1;
+}
+
+// The dirty stamp of a free block of at least PURGE_MIN_SIZE bytes.
+static inline size_t* dirty_stamp(block_info* block) {
+  return (size_t*) UNSCALED_POINTER_ADD(block, sizeof(block_info));
+}
+
+// Returns the dirty stamp of any free block: small blocks don't keep one, so
+// they count as dirty as of 'now' unless they are known to be zero.
+static size_t block_dirty_stamp(block_info* block, size_t now) {
+  if (SIZE(block->size_and_tags) >= PURGE_MIN_SIZE) {
+    return *dirty_stamp(block);
   }
+  return (block->size_and_tags & TAG_ZEROED) ? 0 : now;
+}
+
+
+/*
+ * Zero the footer preceding 'block' and block's header and next/prev ptrs,
+ * which are about to become the middle of a coalesced free block.
+ */
+static void clear_block_boundary(block_info* block) {
+  *(tag_t*) UNSCALED_POINTER_SUB(block, TAG_SIZE) = 0;
+  block->size_and_tags = 0;
+  block->next = to_link(NULL);
+  block->prev = to_link(NULL);
 }
 
 
-/* Coalesce 'old_block' with any preceding or following free blocks. */
+/*
+ * Coalesce 'old_block' with any preceding or following free blocks.
+ *  - Because coalescing is immediate, no two free blocks are ever adjacent,
+ *    so there is at most one free block on either side and this takes
+ *    constant time.
+ */
 static void coalesce_free_block(block_info* old_block) {
   block_info* block_cursor;
   block_info* new_block;
@@ -215,22 +1110,31 @@ static void coalesce_free_block(block_info* old_block) {
   size_t old_size = SIZE(old_block->size_and_tags);
   // running sum to be size of final coalesced block
   size_t new_size = old_size;
+  // whether every block merged so far is known to be zero, and the blocks
+  // whose header, next/prev ptrs and preceding footer end up in the middle of
+  // the coalesced block
+  size_t zeroed = old_block->size_and_tags & TAG_ZEROED;
+  block_info* preceding_boundary = NULL;
+  block_info* following_boundary = NULL;
 
   // Coalesce with any preceding free block
   block_cursor = old_block;
-  while ((block_cursor->size_and_tags & TAG_PRECEDING_USED) == 0) {
-    // While the block preceding this one in memory (not the
+  if ((block_cursor->size_and_tags & TAG_PRECEDING_USED) == 0) {
+    // If the block preceding this one in memory (not the
     // prev. block in the free list) is free:
 
     // Get the size of the previous block from its boundary tag.
-    size_t size = SIZE(*((size_t*) UNSCALED_POINTER_SUB(block_cursor, WORD_SIZE)));
+    size_t size = SIZE(*((tag_t*) UNSCALED_POINTER_SUB(block_cursor, TAG_SIZE)));
     // Use this size to find the block info for that block.
     free_block = (block_info*) UNSCALED_POINTER_SUB(block_cursor, size);
     // Remove that block from free list.
     remove_free_block(free_block);
+    locked_arena->coalesce_count++;
 
     // Count that block's size and update the current block pointer.
     new_size += size;
+    zeroed &= free_block->size_and_tags;
+    preceding_boundary = block_cursor;
     block_cursor = free_block;
   }
   new_block = block_cursor;
@@ -238,30 +1142,62 @@ static void coalesce_free_block(block_info* old_block) {
   // Coalesce with any following free block.
   // Start with the block following this one in memory
   block_cursor = (block_info*) UNSCALED_POINTER_ADD(old_block, old_size);
-  while ((block_cursor->size_and_tags & TAG_USED) == 0) {
-    // While following block is free:
+  if ((block_cursor->size_and_tags & TAG_USED) == 0) {
+    // If following block is free:
 
     size_t size = SIZE(block_cursor->size_and_tags);
     // Remove it from the free list.
     remove_free_block(block_cursor);
+    locked_arena->coalesce_count++;
     // Count its size and step to the following block.
     new_size += size;
+    zeroed &= block_cursor->size_and_tags;
+    following_boundary = block_cursor;
     block_cursor = (block_info*) UNSCALED_POINTER_ADD(block_cursor, size);
   }
 
   // If the block actually grew, remove the old entry from the free-list
   // and add the new entry.
   if (new_size != old_size) {
+    // The coalesced block is as dirty as its most recently dirtied piece.
+    size_t stamp = 0;
+    if (new_size >= PURGE_MIN_SIZE && !zeroed) {
+      size_t now = now_ms();
+      stamp = block_dirty_stamp(old_block, now);
+      if (preceding_boundary != NULL) {
+        size_t preceding_stamp = block_dirty_stamp(new_block, now);
+        stamp = preceding_stamp > stamp ? preceding_stamp : stamp;
+      }
+      if (following_boundary != NULL) {
+        size_t following_stamp = block_dirty_stamp(following_boundary, now);
+        stamp = following_stamp > stamp ? following_stamp : stamp;
+      }
+    }
+
     // Remove the original block from the free list
     remove_free_block(old_block);
 
+    // If all the pieces were zero, clear the tags and pointers now in the
+    // middle of the new block so that it is too.
+    if (zeroed) {
+      if (preceding_boundary != NULL) {
+        clear_block_boundary(preceding_boundary);
+      }
+      if (following_boundary != NULL) {
+        clear_block_boundary(following_boundary);
+      }
+    }
+
     // Save the new size in the block info and in the boundary tag
     // and tag it to show the preceding block is used (otherwise, it
     // would have become part of this one!).
-    new_block->size_and_tags = new_size | TAG_PRECEDING_USED;
+    new_block->size_and_tags = new_size | TAG_PRECEDING_USED | zeroed;
     // The boundary tag of the preceding block is the word immediately
     // preceding block in memory where we left off advancing block_cursor.
-    *(size_t*) UNSCALED_POINTER_SUB(block_cursor, WORD_SIZE) = new_size | TAG_PRECEDING_USED;
+    *(tag_t*) UNSCALED_POINTER_SUB(block_cursor, TAG_SIZE) = new_size | TAG_PRECEDING_USED | zeroed;
+    if (new_size >= PURGE_MIN_SIZE) {
+      *dirty_stamp(new_block) = stamp;
+    }
 
     // Put the new block in the free list.
     insert_free_block(new_block);
@@ -270,52 +1206,328 @@ static void coalesce_free_block(block_info* old_block) {
 }
 
 
-/* Get more heap space of size at least req_size. */
-static void request_more_space(size_t req_size) {
+// Return TAG_ZEROED if the heap space from 'start' up to the current break
+// has never been used before, and 0 otherwise. Records the new break as the
+// high-water mark.
+static size_t fresh_space_tag(void* start) {
+  struct arena* arena = locked_arena;
+  size_t tag = (SBRK_MEMORY_IS_ZERO && start >= arena->high_water) ? TAG_ZEROED : 0;
+  if (arena->brk > arena->high_water) {
+    arena->high_water = arena->brk;
+  }
+  return tag;
+}
+
+// Move locked_arena's break by 'incr' bytes. Like mem_sbrk, returns the old
+// break, or (void*) -1 if the heap can't grow or shrink that far.
+static void* heap_sbrk(intptr_t incr) {
+  struct arena* arena = locked_arena;
+  char* old_brk = arena->brk;
+
+#if COMPACT_HEAP
+  // Tags and free-list offsets of a compact heap can't reach past 4 GiB.
+  if (incr > 0 && (size_t) incr > UINT32_MAX - heap_size()) {
+    return (void*) -1;
+  }
+#endif
+  if (arena->limit == NULL) {
+    if (incr < 0 && arena->cant_shrink) {
+      return (void*) -1;
+    }
+    void* result = mem_sbrk(incr);
+    if (result != (void*) -1) {
+      arena->brk = UNSCALED_POINTER_ADD(mem_heap_hi(), 1);
+      arena->sbrk_count++;
+    } else if (incr < 0) {
+      arena->cant_shrink = true;
+    }
+    return result;
+  }
+  if (incr > (char*) arena->limit - old_brk || -incr > old_brk - (char*) arena->lo) {
+    return (void*) -1;
+  }
+  // The region stays mapped, so pages above the new break are released by
+  // hand.
+  if (incr < 0) {
+    uintptr_t pagemask = mem_pagesize() - 1;
+    uintptr_t start = ((uintptr_t) (old_brk + incr) + pagemask) & ~pagemask;
+    uintptr_t end = ((uintptr_t) old_brk + pagemask) & ~pagemask;
+    if (end > start) {
+      madvise((void*) start, end - start, MADV_DONTNEED);
+    }
+  }
+  arena->brk = old_brk + incr;
+  arena->sbrk_count++;
+  return old_brk;
+}
+
+
+// Requests of this many bytes or more are served by mmap_chunk_alloc.
+// The thresholds and the growth policy are shared by every arena, and are
+// only ever read and written atomically.
+static size_t mmap_threshold = MMAP_THRESHOLD_MIN;
+
+// mm_free trims the heap when its last free block exceeds this many bytes.
+// Kept at twice the mmap threshold as that adapts.
+static size_t trim_threshold = DEFAULT_TRIM_THRESHOLD;
+
+// Heap growth policy (see mm_set_growth_policy): every extension is at least
+// growth_min_chunk bytes, or growth_percent percent of the current heap size,
+// but the geometric part never goes beyond growth_max_chunk (nor, for heaps
+// that can shrink, half the trim threshold, so a fresh extension isn't
+// immediately trimmed again).
+static size_t growth_min_chunk = DEFAULT_GROWTH_MIN_CHUNK;
+static size_t growth_percent = DEFAULT_GROWTH_PERCENT;
+static size_t growth_max_chunk = DEFAULT_GROWTH_MAX_CHUNK;
+
+// Allocator-wide statistics (see STATISTICS above), only ever read and
+// written atomically: bytes in used heap blocks, mmapped chunks and slab
+// pages, and the most there have been at once; and the mallocs and frees
+// threads have flushed.
+static size_t stats_in_use_bytes;
+static size_t stats_peak_bytes;
+static size_t stats_mmapped_bytes;
+static size_t stats_slab_bytes;
+static size_t stats_malloc_count;
+static size_t stats_free_count;
+
+// Add 'delta' bytes to stats_in_use_bytes, raising the peak if need be.
+static void stats_add_in_use(ssize_t delta) {
+  size_t in_use = __atomic_add_fetch(&stats_in_use_bytes, delta, __ATOMIC_RELAXED);
+  size_t peak = __atomic_load_n(&stats_peak_bytes, __ATOMIC_RELAXED);
+  while (in_use > peak &&
+         !__atomic_compare_exchange_n(&stats_peak_bytes, &peak, in_use, true,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+  }
+}
+
+// Account for 'delta' more bytes in locked_arena's used blocks, publishing
+// them once enough have accumulated.
+static void heap_count_in_use(ssize_t delta) {
+  struct arena* arena = locked_arena;
+  arena->in_use_bytes += delta;
+  if (arena->in_use_bytes > arena->peak_bytes) {
+    arena->peak_bytes = arena->in_use_bytes;
+  }
+  ssize_t unpublished = arena->in_use_bytes - arena->published_bytes;
+  if (!arena->is_private &&
+      (unpublished >= STATS_PUBLISH_BYTES || unpublished <= -STATS_PUBLISH_BYTES)) {
+    stats_add_in_use(unpublished);
+    arena->published_bytes = arena->in_use_bytes;
+  }
+}
+
+/*
+ * Get more heap space so that there is a free block of size at least
+ * req_size at the end of the heap. Returns false, leaving the heap as it is,
+ * if the heap can't grow that far.
+ */
+static bool request_more_space(size_t req_size) {
   size_t pagesize = mem_pagesize();
-  size_t num_pages = (req_size + pagesize - 1) / pagesize;
   block_info* new_block;
-  size_t total_size = num_pages * pagesize;
   size_t prev_last_word_mask;
 
-  void* mem_sbrk_result = mem_sbrk(total_size);
+  // A free block at the end of the heap will coalesce with the new space, so
+  // only the difference is needed.
+  tag_t* end_of_heap = (tag_t*) UNSCALED_POINTER_SUB(heap_hi(), TAG_SIZE - 1);
+  if (!(*end_of_heap & TAG_PRECEDING_USED)) {
+    size_t tail_size = SIZE(*(end_of_heap - 1));
+    req_size = tail_size < req_size ? req_size - tail_size : 0;
+  }
+
+  // Grow geometrically with the heap, within the configured bounds.
+  size_t min_chunk = __atomic_load_n(&growth_min_chunk, __ATOMIC_RELAXED);
+  size_t max_chunk = __atomic_load_n(&growth_max_chunk, __ATOMIC_RELAXED);
+  size_t half_trim = __atomic_load_n(&trim_threshold, __ATOMIC_RELAXED) / 2;
+  size_t chunk = heap_size() / 100 * __atomic_load_n(&growth_percent, __ATOMIC_RELAXED);
+  if (!locked_arena->cant_shrink && max_chunk > half_trim) {
+    max_chunk = half_trim;
+  }
+  if (chunk > max_chunk) {
+    chunk = max_chunk;
+  }
+  if (chunk < min_chunk) {
+    chunk = min_chunk;
+  }
+  if (chunk < req_size) {
+    chunk = req_size;
+  }
+  size_t num_pages = (chunk + pagesize - 1) / pagesize;
+  size_t total_size = num_pages * pagesize;
+
+  void* mem_sbrk_result = heap_sbrk(total_size);
   if ((size_t) mem_sbrk_result == -1) {
-    printf("ERROR: mem_sbrk failed in request_more_space\n");
-    exit(0);
+    // The heap may still have room for what was asked for, if not for the
+    // whole chunk.
+    total_size = (req_size + pagesize - 1) / pagesize * pagesize;
+    if (total_size == 0) {
+      total_size = pagesize;
+    }
+    mem_sbrk_result = heap_sbrk(total_size);
+    if (mem_sbrk_result == (void*) -1) {
+      return false;
+    }
   }
-  new_block = (block_info*) UNSCALED_POINTER_SUB(mem_sbrk_result, WORD_SIZE);
+  new_block = (block_info*) UNSCALED_POINTER_SUB(mem_sbrk_result, TAG_SIZE);
 
   // Initialize header by inheriting TAG_PRECEDING_USED status from the
-  // end-of-heap word and resetting the TAG_USED bit.
-  prev_last_word_mask = new_block->size_and_tags & TAG_PRECEDING_USED;
+  // end-of-heap word and resetting the TAG_USED bit. The old end-of-heap
+  // word becomes the header, so only the new space decides TAG_ZEROED.
+  prev_last_word_mask = (new_block->size_and_tags & TAG_PRECEDING_USED) |
+                        fresh_space_tag(mem_sbrk_result);
   new_block->size_and_tags = total_size | prev_last_word_mask;
   // Initialize new footer
-  ((block_info*) UNSCALED_POINTER_ADD(new_block, total_size - WORD_SIZE))->size_and_tags =
+  ((block_info*) UNSCALED_POINTER_ADD(new_block, total_size - TAG_SIZE))->size_and_tags =
           total_size | prev_last_word_mask;
 
+  // Fresh space is clean; space reused after a trim is not known to be.
+  if (total_size >= PURGE_MIN_SIZE) {
+    *dirty_stamp(new_block) = (prev_last_word_mask & TAG_ZEROED) ? 0 : now_ms();
+  }
+
   // Initialize new end-of-heap word: SIZE is 0, TAG_PRECEDING_USED is 0,
   // TAG_USED is 1. This trick lets us do the "normal" check even at the end
   // of the heap.
-  *((size_t*) UNSCALED_POINTER_ADD(new_block, total_size)) = TAG_USED;
+  *((tag_t*) UNSCALED_POINTER_ADD(new_block, total_size)) = TAG_USED;
 
   // Add the new block to the free list and immediately coalesce newly
   // allocated memory space.
   insert_free_block(new_block);
   coalesce_free_block(new_block);
+  return true;
 }
 
 
-/* Initialize the allocator. */
-int mm_init() {
+// Incremented by mm_init, which starts a new heap and so invalidates every
+// thread cache.
+static unsigned long heap_generation;
+
+
+/*
+ * If the last block in the heap is free, give all of it but 'pad' bytes
+ * (rounded so the break moves by whole pages) back with a negative mem_sbrk
+ * and move the end-of-heap word down. Returns the number of bytes released.
+ */
+static size_t trim_heap_top(size_t pad) {
+  size_t pagesize = mem_pagesize();
+  tag_t* end_of_heap = (tag_t*) UNSCALED_POINTER_SUB(heap_hi(), TAG_SIZE - 1);
+
+  // The end-of-heap word tells us whether the last block is free.
+  if (*end_of_heap & TAG_PRECEDING_USED) {
+    return 0;
+  }
+  size_t last_size = SIZE(*(end_of_heap - 1));
+  block_info* last_block = (block_info*) UNSCALED_POINTER_SUB(end_of_heap, last_size);
+
+  // Always keep a free block of at least MIN_BLOCK_SIZE.
+  size_t keep = ALIGNMENT * ((pad + ALIGNMENT - 1) / ALIGNMENT);
+  if (keep < MIN_BLOCK_SIZE) {
+    keep = MIN_BLOCK_SIZE;
+  }
+  if (last_size <= keep + pagesize) {
+    return 0;
+  }
+  size_t release = (last_size - keep) & ~(pagesize - 1);
+
+  // memlib may refuse to shrink the heap; then there is nothing to undo.
+  if ((ssize_t) heap_sbrk(-(ssize_t) release) == -1) {
+    return 0;
+  }
+
+  size_t tags = last_block->size_and_tags & (ALIGNMENT - 1);
+  remove_free_block(last_block);
+  putSizeAndTags(last_block, (last_size - release) | tags);
+  insert_free_block(last_block);
+
+  // New end-of-heap word, preceded by a free block.
+  *(tag_t*) UNSCALED_POINTER_ADD(last_block, last_size - release) = TAG_USED;
+  return release;
+}
+
+
+// How long a block may stay dirty before it is purged (see PURGING above).
+// Shared by every arena and accessed atomically.
+static long purge_decay_ms = DEFAULT_PURGE_DECAY_MS;
+
+// Release the interior pages of 'block' if it is dirty since at least
+// 'decay_ms' before 'now'. Returns the number of bytes released.
+static size_t purge_block(block_info* block, size_t now, size_t decay_ms) {
+  size_t stamp = *dirty_stamp(block);
+  if (stamp == 0 || now - stamp < decay_ms) {
+    return 0;
+  }
+  size_t pagesize = mem_pagesize();
+  uintptr_t start = ((uintptr_t) dirty_stamp(block) + sizeof(size_t) + pagesize - 1) & ~(uintptr_t) (pagesize - 1);
+  uintptr_t end = ((uintptr_t) block + SIZE(block->size_and_tags) - TAG_SIZE) & ~(uintptr_t) (pagesize - 1);
+  if (end <= start || madvise((void*) start, end - start, PURGE_ADVICE) != 0) {
+    return 0;
+  }
+  *dirty_stamp(block) = 0;
+  locked_arena->purged_bytes += end - start;
+  return end - start;
+}
+
+// Purge every free block of at least PURGE_MIN_SIZE bytes that has been dirty
+// for 'decay_ms'. Returns the number of bytes released.
+static size_t purge_dirty_blocks(size_t now, size_t decay_ms) {
+  size_t released = 0;
+
+#if FIT_POLICY == FIT_SEGREGATED
+  // All candidates are in the tree. Walk it in order with Morris traversal,
+  // which needs no stack and leaves the tree as it found it.
+  block_info* node = FREE_INDEX->tree_root;
+  while (node != NULL) {
+    if (from_link(node->left) == NULL) {
+      if (SIZE(node->size_and_tags) >= PURGE_MIN_SIZE) {
+        released += purge_block(node, now, decay_ms);
+      }
+      node = from_link(node->right);
+    } else {
+      block_info* pred = from_link(node->left);
+      while (from_link(pred->right) != NULL && from_link(pred->right) != node) {
+        pred = from_link(pred->right);
+      }
+      if (from_link(pred->right) == NULL) {
+        pred->right = to_link(node);
+        node = from_link(node->left);
+      } else {
+        pred->right = to_link(NULL);
+        if (SIZE(node->size_and_tags) >= PURGE_MIN_SIZE) {
+          released += purge_block(node, now, decay_ms);
+        }
+        node = from_link(node->right);
+      }
+    }
+  }
+#else
+  for (int class = size_class(PURGE_MIN_SIZE); class < NUM_SIZE_CLASSES; class++) {
+    for (block_info* block = FREE_LIST_HEAD(class); block != NULL; block = from_link(block->next)) {
+      if (SIZE(block->size_and_tags) >= PURGE_MIN_SIZE) {
+        released += purge_block(block, now, decay_ms);
+      }
+    }
+  }
+#endif
+  return released;
+}
+
+
+/*
+ * Set up an empty heap at the break of locked_arena, which must be at its
+ * start, and reset the arena's counters.
+ */
+static void heap_init() {
+  struct arena* arena = locked_arena;
   // Head of the free list.
   block_info* first_free_block;
 
-  // Initial heap size: WORD_SIZE byte heap-header (stores pointer to head
-  // of free list), MIN_BLOCK_SIZE bytes of space, WORD_SIZE byte heap-footer.
-  size_t init_size = WORD_SIZE + MIN_BLOCK_SIZE + WORD_SIZE;
+  // Initial heap size: HEAP_HEADER_SIZE byte heap-header (stores pointers to
+  // the heads of the free lists), MIN_BLOCK_SIZE bytes of space, TAG_SIZE
+  // byte heap-footer. The heap-header leaves the first payload aligned.
+  size_t init_size = HEAP_HEADER_SIZE + MIN_BLOCK_SIZE + TAG_SIZE;
   size_t total_size;
 
-  void* mem_sbrk_result = mem_sbrk(init_size);
+  void* mem_sbrk_result = heap_sbrk(init_size);
   //  printf("mem_sbrk returned %p\n", mem_sbrk_result);
   if ((ssize_t) mem_sbrk_result == -1) {
     printf("ERROR: mem_sbrk failed in mm_init, returning %p\n",
@@ -323,63 +1535,462 @@ int mm_init() {
     exit(1);
   }
 
-  first_free_block = (block_info*) UNSCALED_POINTER_ADD(mem_heap_lo(), WORD_SIZE);
+  first_free_block = (block_info*) UNSCALED_POINTER_ADD(heap_lo(), HEAP_HEADER_SIZE);
+  size_t zeroed = fresh_space_tag(first_free_block);
 
   // Total usable size is full size minus heap-header and heap-footer words.
   // NOTE: These are different than the "header" and "footer" of a block!
-  //  - The heap-header is a pointer to the first free block in the free list.
+  //  - The heap-header is the array of free-list heads, one per size class.
   //  - The heap-footer is the end-of-heap indicator (used block with size 0).
-  total_size = init_size - WORD_SIZE - WORD_SIZE;
+  total_size = init_size - HEAP_HEADER_SIZE - TAG_SIZE;
 
   // The heap starts with one free block, which we initialize now.
-  first_free_block->size_and_tags = total_size | TAG_PRECEDING_USED;
-  first_free_block->next = NULL;
-  first_free_block->prev = NULL;
+  first_free_block->size_and_tags = total_size | TAG_PRECEDING_USED | zeroed;
+  first_free_block->next = to_link(NULL);
+  first_free_block->prev = to_link(NULL);
   // Set the free block's footer.
-  *((size_t*) UNSCALED_POINTER_ADD(first_free_block, total_size - WORD_SIZE)) =
-	  total_size | TAG_PRECEDING_USED;
+  *((tag_t*) UNSCALED_POINTER_ADD(first_free_block, total_size - TAG_SIZE)) =
+	  total_size | TAG_PRECEDING_USED | zeroed;
 
   // Tag the end-of-heap word at the end of heap as used.
-  *((size_t*) UNSCALED_POINTER_SUB(mem_heap_hi(), WORD_SIZE - 1)) = TAG_USED;
+  *((tag_t*) UNSCALED_POINTER_SUB(heap_hi(), TAG_SIZE - 1)) = TAG_USED;
 
-  // Set the head of the free list to this new free block.
-  FREE_LIST_HEAD = first_free_block;
-  return 0;
+  // Start with every free list empty, then put this new free block in the
+  // list for its size class.
+  memset(FREE_INDEX, 0, sizeof(struct free_index));
+  insert_free_block(first_free_block);
+
+  memset(arena->fastbins, 0, sizeof(arena->fastbins));
+  arena->fastbin_bytes = 0;
+  arena->realloc_count = 0;
+  arena->realloc_in_place_count = 0;
+  arena->last_purge_sweep = now_ms();
+  arena->frees_since_purge_check = 0;
+  arena->purged_bytes = 0;
+  arena->in_use_bytes = 0;
+  arena->published_bytes = 0;
+  arena->peak_bytes = 0;
+  arena->split_count = 0;
+  arena->coalesce_count = 0;
+  arena->sbrk_count = 0;
+  arena->malloc_count = 0;
+  arena->free_count = 0;
 }
 
 
-// TOP-LEVEL ALLOCATOR INTERFACE ------------------------------------
+// SLABS ------------------------------------------------------------
 
-/*
- * Allocate a block of size size and return a pointer to it. If size is zero,
- * returns NULL.
- */
-/* Allocate a block of size size and return a pointer to it. */
-// Function to update the pointers when a block is split.
-// This function updates pointers when a free block is split.
-void update_pointers_on_split(block_info* ptrFreeBlock, block_info* leftFreeBlock) {
+// Returns true if 'ptr' is a slab object rather than a heap block.
+static inline bool is_slab(void* ptr) {
+  return (char*) ptr >= slab_base && (char*) ptr < slab_end;
+}
+
+// Returns the page holding the slab object at 'ptr'.
+static inline struct slab_page* slab_page_of(void* ptr) {
+  return (struct slab_page*) ((uintptr_t) ptr & ~(uintptr_t) (SLAB_PAGE_SIZE - 1));
+}
+
+// Returns the class of slab objects of 'size' (1 to SLAB_MAX_SIZE) bytes.
+static inline int slab_size_class(size_t size) {
+  return (size - 1) / ALIGNMENT;
+}
+
+// Reserve the slab region on the first call, and on later ones empty it,
+// giving back the memory of every page that has been used.
+static void slab_init() {
+    if(slab_base == NULL){
+        char *region = mmap(NULL, SLAB_REGION_SIZE, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if(region == MAP_FAILED){
+            return;
+        }
+        for(int i = 0; i < SLAB_NUM_CLASSES; i++){
+            pthread_mutex_init(&slab_classes[i].lock, NULL);
+        }
+        slab_base = region;
+        slab_end = region + SLAB_REGION_SIZE;
+    } else {
+        madvise(slab_base, slab_brk - slab_base, MADV_DONTNEED);
+    }
+    slab_brk = slab_base;
+    memset(slab_free_pages, 0, sizeof(slab_free_pages));
+    for(int i = 0; i < SLAB_NUM_CLASSES; i++){
+        slab_classes[i].pages = NULL;
+    }
+}
+
+// Take an empty page (reusing one if possible) and set it up for slots of
+// 'size' bytes. Returns NULL if the region is used up.
+static struct slab_page* slab_page_alloc(size_t size) {
+    struct slab_page *page = NULL;
+    pthread_mutex_lock(&slab_lock);
+    size_t words = ((slab_brk - slab_base) / SLAB_PAGE_SIZE + 63) / 64;
+    for(size_t i = 0; i < words; i++){
+        if(slab_free_pages[i] != 0){
+            int bit = __builtin_ctzll(slab_free_pages[i]);
+            slab_free_pages[i] &= slab_free_pages[i] - 1;
+            page = (struct slab_page*) (slab_base + (i * 64 + bit) * SLAB_PAGE_SIZE);
+            break;
+        }
+    }
+    if(page == NULL && slab_brk < slab_end){
+        page = (struct slab_page*) slab_brk;
+        slab_brk += SLAB_PAGE_SIZE;
+    }
+    pthread_mutex_unlock(&slab_lock);
+    if(page == NULL){
+        return NULL;
+    }
+    __atomic_add_fetch(&stats_slab_bytes, SLAB_PAGE_SIZE, __ATOMIC_RELAXED);
+    stats_add_in_use(SLAB_PAGE_SIZE);
+
+    page->next = NULL;
+    page->prev = NULL;
+    page->size = size;
+    page->slots = (SLAB_PAGE_SIZE - SLAB_HEADER_SIZE) / size;
+    page->free = page->slots;
+    for(int i = 0; i < SLAB_BITMAP_WORDS; i++){
+        int bits = page->slots - i * 64;
+        page->bitmap[i] = bits >= 64 ? ~(uint64_t) 0 : bits > 0 ? ((uint64_t) 1 << bits) - 1 : 0;
+    }
+    return page;
+}
+
+// Give the empty page 'page' back to the pool, releasing its memory.
+static void slab_page_free(struct slab_page* page) {
+    madvise(page, SLAB_PAGE_SIZE, PURGE_ADVICE);
+    size_t index = ((char*) page - slab_base) / SLAB_PAGE_SIZE;
+    pthread_mutex_lock(&slab_lock);
+    slab_free_pages[index / 64] |= (uint64_t) 1 << (index % 64);
+    pthread_mutex_unlock(&slab_lock);
+    __atomic_sub_fetch(&stats_slab_bytes, SLAB_PAGE_SIZE, __ATOMIC_RELAXED);
+    stats_add_in_use(-(ssize_t)SLAB_PAGE_SIZE);
+}
+
+// Add 'page' to / remove it from the list of pages with free slots in
+// 'class'. Called with the class's lock held.
+static void slab_list_insert(struct slab_class* class, struct slab_page* page) {
+    page->prev = NULL;
+    page->next = class->pages;
+    if(class->pages != NULL){
+        class->pages->prev = page;
+    }
+    class->pages = page;
+}
+
+static void slab_list_remove(struct slab_class* class, struct slab_page* page) {
+    if(page->prev != NULL){
+        page->prev->next = page->next;
+    } else {
+        class->pages = page->next;
+    }
+    if(page->next != NULL){
+        page->next->prev = page->prev;
+    }
+}
+
+// Allocate up to 'n' objects of slab class 'cls', storing pointers to them in
+// 'ptrs'. Returns how many were allocated, which is less than 'n' only if the
+// region is used up.
+static size_t slab_alloc(int cls, void **ptrs, size_t n) {
+    struct slab_class *class = &slab_classes[cls];
+    size_t size = (cls + 1) * ALIGNMENT;
+    size_t taken = 0;
+    pthread_mutex_lock(&class->lock);
+    while(taken < n){
+        struct slab_page *page = class->pages;
+        if(page == NULL){
+            page = slab_page_alloc(size);
+            if(page == NULL){
+                break;
+            }
+            slab_list_insert(class, page);
+        }
+
+        // Take the lowest free slots, a word of the bitmap at a time
+        char *slots = (char*) page + SLAB_HEADER_SIZE;
+        for(int i = 0; i < SLAB_BITMAP_WORDS && taken < n && page->free > 0; i++){
+            uint64_t bits = page->bitmap[i];
+            while(bits != 0 && taken < n){
+                ptrs[taken++] = slots + (i * 64 + __builtin_ctzll(bits)) * size;
+                bits &= bits - 1;
+                page->free--;
+            }
+            page->bitmap[i] = bits;
+        }
+        if(page->free == 0){
+            slab_list_remove(class, page);
+        }
+    }
+    pthread_mutex_unlock(&class->lock);
+    return taken;
+}
+
+// Free the 'n' slab objects at 'ptrs', which may be of any classes. Each run
+// of objects of one class is freed under a single lock. A page that becomes
+// empty goes back to the pool, unless it is the only one its class has left.
+static void slab_free_objects(void **ptrs, size_t n) {
+    struct slab_class *locked = NULL;
+    for(size_t i = 0; i < n; i++){
+        struct slab_page *page = slab_page_of(ptrs[i]);
+        struct slab_class *class = &slab_classes[slab_size_class(page->size)];
+        if(class != locked){
+            if(locked != NULL){
+                pthread_mutex_unlock(&locked->lock);
+            }
+            pthread_mutex_lock(&class->lock);
+            locked = class;
+        }
+
+        size_t slot = ((char*) ptrs[i] - (char*) page - SLAB_HEADER_SIZE) / page->size;
+        uint64_t bit = (uint64_t) 1 << (slot % 64);
+        assert(!(page->bitmap[slot / 64] & bit));
+        page->bitmap[slot / 64] |= bit;
+        if(page->free++ == 0){
+            slab_list_insert(class, page);
+        } else if(page->free == page->slots && (page->prev != NULL || page->next != NULL)){
+            slab_list_remove(class, page);
+            slab_page_free(page);
+        }
+    }
+    if(locked != NULL){
+        pthread_mutex_unlock(&locked->lock);
+    }
+}
+
+
+/* Initialize the allocator. */
+int mm_init() {
+  // The main arena is memlib's heap.
+  main_arena.lo = mem_heap_lo();
+  main_arena.brk = UNSCALED_POINTER_ADD(mem_heap_hi(), 1);
+  locked_arena = &main_arena;
+  heap_init();
+
+  // Other arenas keep their regions but start over with empty heaps.
+  for (unsigned int i = 1; i < num_arenas; i++) {
+    locked_arena = arenas[i];
+    heap_sbrk(-(intptr_t) heap_size());
+    heap_init();
+  }
+  locked_arena = &main_arena;
+
+#if PERCPU_CACHE
+  // Blocks from before are gone, as for the thread caches.
+  if (percpu_caches != NULL) {
+    memset(percpu_caches, 0, percpu_count * sizeof(struct percpu_cache));
+  }
+#endif
+  slab_init();
+  stats_in_use_bytes = 0;
+  stats_peak_bytes = 0;
+  stats_mmapped_bytes = 0;
+  stats_slab_bytes = 0;
+  stats_malloc_count = 0;
+  stats_free_count = 0;
+  mmap_threshold = MMAP_THRESHOLD_MIN;
+  trim_threshold = DEFAULT_TRIM_THRESHOLD;
+  heap_generation++;
+  return 0;
+}
+
+
+// ARENAS -----------------------------------------------------------
+
+// Protects the list of arenas and their thread counts.
+static pthread_mutex_t arenas_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Number of arenas threads are spread over (0 until the first thread is
+// assigned one), and the next one in round-robin order.
+static unsigned int arena_limit;
+static unsigned int next_arena;
+
+// Returns the arena owning the heap block at 'ptr'. Anything outside the
+// other arenas' regions belongs to the main arena.
+static struct arena* arena_of(void* ptr) {
+    uintptr_t region = (uintptr_t)ptr & ~(uintptr_t)(ARENA_REGION_SIZE - 1);
+    unsigned int count = __atomic_load_n(&num_arenas, __ATOMIC_ACQUIRE);
+    for(unsigned int i = 1; i < count; i++){
+        if((uintptr_t)arenas[i] == region){
+            return arenas[i];
+        }
+    }
+    return &main_arena;
+}
+
+// Lock 'arena' and make it the one the heap_* functions work on. Returns true
+// if the lock had to be waited for.
+static bool arena_lock(struct arena* arena) {
+    bool contended = pthread_mutex_trylock(&arena->lock) != 0;
+    if(contended){
+        pthread_mutex_lock(&arena->lock);
+    }
+    locked_arena = arena;
+    return contended;
+}
+
+static void arena_unlock(struct arena* arena) {
+    pthread_mutex_unlock(&arena->lock);
+}
+
+// Reserve an aligned region for an arena, with the arena itself at its start
+// followed by an empty heap. Returns NULL if the region can't be mapped.
+static struct arena* arena_create() {
+    size_t regionSize = ARENA_REGION_SIZE;
+
+    // Map twice the size so an aligned region fits, then give back the rest
+    char *map = mmap(NULL, 2 * regionSize, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if(map == MAP_FAILED){
+        return NULL;
+    }
+    char *region = (char*)(((uintptr_t)map + regionSize - 1) & ~(uintptr_t)(regionSize - 1));
+    if(region > map){
+        munmap(map, region - map);
+    }
+    munmap(region + regionSize, map + regionSize - region);
+
+    // The mapping is fresh, so all of the heap starts out zero
+    struct arena *arena = (struct arena*)region;
+    pthread_mutex_init(&arena->lock, NULL);
+    arena->lo = region + ALIGNMENT * ((sizeof(struct arena) + ALIGNMENT - 1) / ALIGNMENT);
+    arena->brk = arena->lo;
+    arena->limit = region + regionSize;
+    arena->high_water = arena->lo;
+
+    // Nobody else can see the arena yet, so it needs no lock
+    struct arena *held = locked_arena;
+    locked_arena = arena;
+    heap_init();
+    locked_arena = held;
+    return arena;
+}
+
+// Create a new arena and add it to the list. Returns NULL if there is no room
+// for another arena. Called with arenas_lock held.
+static struct arena* arena_add() {
+    if(num_arenas == MAX_ARENAS){
+        return NULL;
+    }
+    struct arena *arena = arena_create();
+    if(arena == NULL){
+        return NULL;
+    }
+    arenas[num_arenas] = arena;
+    __atomic_store_n(&num_arenas, num_arenas + 1, __ATOMIC_RELEASE);
+    return arena;
+}
+
+// Pick an arena for a new thread, round-robin over arena_limit arenas that
+// are created as they are first needed.
+static struct arena* arena_assign() {
+    pthread_mutex_lock(&arenas_lock);
+    if(arena_limit == 0){
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        arena_limit = cpus > 0 && cpus < MAX_ARENAS / ARENAS_PER_CPU ? cpus * ARENAS_PER_CPU : MAX_ARENAS;
+    }
+    unsigned int index = next_arena++ % arena_limit;
+    struct arena *arena = NULL;
+    if(index < num_arenas){
+        arena = arenas[index];
+    } else {
+        arena = arena_add();
+    }
+    if(arena == NULL){
+        arena = &main_arena;
+    }
+    arena->threads++;
+    pthread_mutex_unlock(&arenas_lock);
+    return arena;
+}
+
+// Move a thread off 'current', an arena whose lock it keeps finding taken, to
+// the least loaded arena, or to a new one if they are all at least as busy.
+// Returns the thread's arena, which stays 'current' if no other is better.
+static struct arena* arena_rebalance(struct arena* current) {
+    pthread_mutex_lock(&arenas_lock);
+    struct arena *best = current;
+    for(unsigned int i = 0; i < num_arenas; i++){
+        if(arenas[i]->threads < best->threads){
+            best = arenas[i];
+        }
+    }
+    // Moving has to leave this thread with fewer neighbours than it had
+    if(best->threads + 1 >= current->threads && num_arenas < arena_limit){
+        struct arena *arena = arena_add();
+        if(arena != NULL){
+            best = arena;
+        }
+    }
+    if(best->threads + 1 < current->threads){
+        current->threads--;
+        best->threads++;
+        current = best;
+    }
+    pthread_mutex_unlock(&arenas_lock);
+    return current;
+}
+
+// Release an arena's thread when the thread exits.
+static void arena_release(struct arena* arena) {
+    pthread_mutex_lock(&arenas_lock);
+    arena->threads--;
+    pthread_mutex_unlock(&arenas_lock);
+}
+
+
+// TOP-LEVEL ALLOCATOR INTERFACE ------------------------------------
+
+/*
+ * Allocate a block of size size and return a pointer to it. If size is zero,
+ * returns NULL.
+ */
+/* Allocate a block of size size and return a pointer to it. */
+// Function to update the pointers when a block is split.
+// This function updates pointers when a free block is split. 'oldClass' is the
+// size class the free block was filed under before it was split.
+void update_pointers_on_split(block_info* ptrFreeBlock, block_info* leftFreeBlock, int oldClass) {
+#if FIT_POLICY == FIT_SEGREGATED
+    // Tree blocks are keyed by size, so the left over block always has to be
+    // reinserted. The key the free block was filed under is the combined size
+    // of the two halves.
+    if(oldClass == TREE_CLASS){
+        tree_remove(ptrFreeBlock, SIZE(ptrFreeBlock->size_and_tags) + SIZE(leftFreeBlock->size_and_tags));
+        insert_free_block(leftFreeBlock);
+        return;
+    }
+#endif
+
+    // If the left over block belongs to a different size class, move it there
+    if(size_class(SIZE(leftFreeBlock->size_and_tags)) != oldClass){
+        unlink_free_block(ptrFreeBlock, oldClass);
+        insert_free_block(leftFreeBlock);
+        return;
+    }
+
+    // Otherwise it takes the free block's place in the same list.
     // Check if the free block is at the start of the free list
-    if(FREE_LIST_HEAD != ptrFreeBlock){
+    if(FREE_LIST_HEAD(oldClass) != ptrFreeBlock){
         // If it isn't, update the next pointer of the previous block
-        ptrFreeBlock->prev->next = leftFreeBlock;
+        from_link(ptrFreeBlock->prev)->next = to_link(leftFreeBlock);
         leftFreeBlock->prev = ptrFreeBlock->prev;
     } else {
         // If it is, make the left free block start the free list
-        leftFreeBlock->prev = NULL;
+        leftFreeBlock->prev = to_link(NULL);
     }
 
     // Update the next pointer of the left free block
     leftFreeBlock->next = ptrFreeBlock->next;
 
     // Check if the next block exists
-    if(ptrFreeBlock->next != NULL){
+    if(from_link(ptrFreeBlock->next) != NULL){
         // If it does, update its previous pointer to point to the left free block
-        ptrFreeBlock->next->prev = leftFreeBlock;
+        from_link(ptrFreeBlock->next)->prev = to_link(leftFreeBlock);
     }
 
     // If the free block was the head of the list, make the left free block the new head
-    if(FREE_LIST_HEAD == ptrFreeBlock){
-        FREE_LIST_HEAD = leftFreeBlock;
+    if(FREE_LIST_HEAD(oldClass) == ptrFreeBlock){
+        FREE_LIST_HEAD(oldClass) = leftFreeBlock;
     }
 }
 
@@ -387,102 +1998,2239 @@ void update_pointers_on_split(block_info* ptrFreeBlock, block_info* leftFreeBloc
 void split_free_block(block_info* ptrFreeBlock, size_t reqSize) {
     // Calculate the size of the left over block after allocation
     size_t leftSize = SIZE(ptrFreeBlock->size_and_tags) - reqSize;
+    // Remember which free list the block is in before its tags change
+    int oldClass = size_class(SIZE(ptrFreeBlock->size_and_tags));
+
+    // The left over block is carved from the middle of this one, so it is
+    // zero (and dirty) if this one is
+    size_t zeroed = ptrFreeBlock->size_and_tags & TAG_ZEROED;
+    size_t stamp = leftSize >= PURGE_MIN_SIZE ? *dirty_stamp(ptrFreeBlock) : 0;
 
     // If the size is larger than the minimum size, split the block
     if(leftSize >= MIN_BLOCK_SIZE){
-        // Mark the block as used
-        putSizeAndTags(ptrFreeBlock, reqSize | TAG_USED | TAG_PRECEDING_USED);
+        // Mark the block as used. Used blocks only have a header, so their
+        // last word is payload.
+        putTags(ptrFreeBlock, reqSize | TAG_USED | (ptrFreeBlock->size_and_tags & TAG_PRECEDING_USED));
 
         // Create a new block with the left over space
         block_info *leftFreeBlock = (block_info*)UNSCALED_POINTER_ADD(ptrFreeBlock, reqSize);
         // Mark the new block as free
-        putSizeAndTags(leftFreeBlock, leftSize | TAG_PRECEDING_USED &(~TAG_USED));
+        putSizeAndTags(leftFreeBlock, leftSize | TAG_PRECEDING_USED | zeroed);
+        if(leftSize >= PURGE_MIN_SIZE){
+            *dirty_stamp(leftFreeBlock) = stamp;
+        }
 
         // Update the pointers of the free list
-        update_pointers_on_split(ptrFreeBlock, leftFreeBlock);
+        update_pointers_on_split(ptrFreeBlock, leftFreeBlock, oldClass);
+        locked_arena->split_count++;
+        heap_count_in_use(reqSize);
     } else {
         // If the block is too small to split, just mark it as used
-        putSizeAndTags(ptrFreeBlock, ptrFreeBlock->size_and_tags | TAG_USED);
+        putTags(ptrFreeBlock, (ptrFreeBlock->size_and_tags | TAG_USED) & ~TAG_ZEROED);
 
         // Get the following block
         block_info *followingBlock = (block_info *)UNSCALED_POINTER_ADD(ptrFreeBlock, SIZE(ptrFreeBlock->size_and_tags));
         // If it's within the heap, update its preceding used tag
-        if(followingBlock < mem_heap_hi()){
-            putSizeAndTags(followingBlock, followingBlock->size_and_tags | TAG_PRECEDING_USED);
+        if(followingBlock < heap_hi()){
+            setTag(followingBlock, TAG_PRECEDING_USED);
         }
         
         // Remove the used block from the free list
-        remove_free_block(ptrFreeBlock);
+        unlink_free_block(ptrFreeBlock, oldClass);
+        heap_count_in_use(SIZE(ptrFreeBlock->size_and_tags));
     }
 }
 
-// The main malloc function.
-void* mm_malloc (size_t size) {
-    // If size is 0, return NULL
-    if (size == 0) {
-        return NULL;
+// Return the used block 'blockInfo' to the free list, coalescing it with its
+// neighbours, and trim or purge the heap if that is now due.
+static void heap_free_block(block_info* blockInfo) {
+    heap_count_in_use(-(ssize_t)SIZE(blockInfo->size_and_tags));
+    clearTag(blockInfo, TAG_USED);
+    if(SIZE(blockInfo->size_and_tags) >= PURGE_MIN_SIZE){
+        *dirty_stamp(blockInfo) = now_ms();
     }
 
-    // Calculate the required size, taking into account alignment and overhead
-    size += WORD_SIZE;
-    size_t reqSize;
-    if(size <= MIN_BLOCK_SIZE) {
-        reqSize = MIN_BLOCK_SIZE;
-    } else {
-        reqSize = ALIGNMENT * ((size + ALIGNMENT - 1) / ALIGNMENT);
+    block_info * followingBlock = (block_info *)UNSCALED_POINTER_ADD(blockInfo, SIZE(blockInfo->size_and_tags));
+    if(followingBlock < heap_hi()){
+        clearTag(followingBlock, TAG_PRECEDING_USED);
+    }
+  
+    insert_free_block(blockInfo);
+    coalesce_free_block(blockInfo);
+
+    // If the heap now ends in a big enough free block, give it back
+    tag_t *endOfHeap = (tag_t*)UNSCALED_POINTER_SUB(heap_hi(), TAG_SIZE - 1);
+    if(!(*endOfHeap & TAG_PRECEDING_USED) &&
+       SIZE(*(endOfHeap - 1)) > __atomic_load_n(&trim_threshold, __ATOMIC_RELAXED)){
+        trim_heap_top(TRIM_PAD);
     }
 
+    // Every so often, purge blocks that have been idle for long enough
+    struct arena *arena = locked_arena;
+    if(++arena->frees_since_purge_check >= PURGE_CHECK_INTERVAL){
+        arena->frees_since_purge_check = 0;
+        size_t now = now_ms();
+        long decayMs = __atomic_load_n(&purge_decay_ms, __ATOMIC_RELAXED);
+        if(decayMs >= 0 && now - arena->last_purge_sweep >= (size_t)decayMs / 4){
+            arena->last_purge_sweep = now;
+            purge_dirty_blocks(now, decayMs);
+        }
+    }
+}
+
+// Empty the fast bins, freeing and coalescing every block in them.
+static void heap_consolidate() {
+    struct arena *arena = locked_arena;
+    if(arena->fastbin_bytes == 0){
+        return;
+    }
+    arena->fastbin_bytes = 0;
+    for(size_t bin = 0; bin < NUM_FASTBINS; bin++){
+        void *payload = arena->fastbins[bin];
+        arena->fastbins[bin] = NULL;
+        while(payload != NULL){
+            void *next = *(void**)payload;
+            heap_free_block((block_info*)UNSCALED_POINTER_SUB(payload, TAG_SIZE));
+            payload = next;
+        }
+    }
+}
+
+// Find a free block of at least reqSize bytes, consolidating the fast bins
+// and then requesting more space if none is large enough. Returns NULL if the
+// heap can't grow enough.
+static block_info* find_free_block(size_t reqSize) {
     block_info *ptrFreeBlock;
     while(1){
         // Search the free list for a block large enough
         ptrFreeBlock = (block_info*)search_free_list(reqSize);
         if(ptrFreeBlock != NULL){
-            // If a suitable block is found, handle the splitting or using of it
-            split_free_block(ptrFreeBlock, reqSize);
-            // Return a pointer to the allocated memory
-            return UNSCALED_POINTER_ADD(ptrFreeBlock, WORD_SIZE);
-        } else {
-            // If no block is found, request more space
-            request_more_space(reqSize);
+            return ptrFreeBlock;
+        }
+        // If no block is found, coalesce what the fast bins hold, or request
+        // more space
+        if(locked_arena->fastbin_bytes != 0){
+            heap_consolidate();
+        } else if(!request_more_space(reqSize)){
+            return NULL;
+        }
+    }
+}
+
+// Allocate a used block of reqSize bytes (possibly a little more, if the
+// free block it comes from is not worth splitting), from the fast bin for
+// that size if it has one. Returns NULL if the heap can't grow enough.
+static block_info* allocate_block(size_t reqSize) {
+    if(reqSize <= FASTBIN_MAX_SIZE){
+        struct arena *arena = locked_arena;
+        int bin = (reqSize - MIN_BLOCK_SIZE) / ALIGNMENT;
+        void *payload = arena->fastbins[bin];
+        if(payload != NULL){
+            arena->fastbins[bin] = *(void**)payload;
+            arena->fastbin_bytes -= reqSize;
+            return (block_info*)UNSCALED_POINTER_SUB(payload, TAG_SIZE);
         }
     }
+    block_info *block = find_free_block(reqSize);
+    if(block != NULL){
+        split_free_block(block, reqSize);
+    }
+    return block;
 }
 
+// Account for 'delta' more bytes in mmapped chunks.
+static void mmap_count_bytes(ssize_t delta) {
+    __atomic_add_fetch(&stats_mmapped_bytes, delta, __ATOMIC_RELAXED);
+    stats_add_in_use(delta);
+}
 
+// Map a chunk of its own for a payload of 'size' bytes aligned to
+// 'alignment'. Returns the chunk's header, or NULL if mmap fails.
+static block_info* mmap_chunk_alloc(size_t size, size_t alignment) {
+    size_t pagesize = mem_pagesize();
+    if(alignment < ALIGNMENT){
+        alignment = ALIGNMENT;
+    }
+    // The mapping is page-aligned, so the first aligned payload after the
+    // header is at most 'alignment' bytes into it
+    size_t mapSize = (size + alignment + pagesize - 1) & ~(pagesize - 1);
 
+    char *map = mmap(NULL, mapSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(map == MAP_FAILED){
+        return NULL;
+    }
+    char *mapEnd = map + mapSize;
 
+    // Place the payload and give back whole pages on either side of it
+    uintptr_t payload = ((uintptr_t)map + TAG_SIZE + alignment - 1) & ~(uintptr_t)(alignment - 1);
+    block_info *block = (block_info*)(payload - TAG_SIZE);
+    char *start = (char*)((uintptr_t)block & ~(uintptr_t)(pagesize - 1));
+    char *end = (char*)((payload + size + pagesize - 1) & ~(uintptr_t)(pagesize - 1));
+    if(start > map){
+        munmap(map, start - map);
+    }
+    if(end < mapEnd){
+        munmap(end, mapEnd - end);
+    }
 
-/* Free the block referenced by ptr. */
-void mm_free(void *ptr) {
-    if(ptr == NULL || ptr<mem_heap_lo() || ptr>mem_heap_hi()){
+    block->size_and_tags = (size_t)(end - start) | TAG_MMAPPED | TAG_USED | TAG_PRECEDING_USED;
+    mmap_count_bytes(end - start);
+    return block;
+}
+
+// Returns the start of the mapping holding the mmapped chunk 'block'.
+static inline void* mmap_chunk_start(block_info* block) {
+    return (void*)((uintptr_t)block & ~(uintptr_t)(mem_pagesize() - 1));
+}
+
+// Returns true if 'ptr' is the payload of a used mmapped chunk. Heap blocks
+// of other threads may be getting TAG_PRECEDING_USED updated under their
+// arena's lock, so the header is read atomically.
+static inline bool is_mmapped_chunk(void* ptr) {
+    block_info *block = (block_info*)UNSCALED_POINTER_SUB(ptr, TAG_SIZE);
+    size_t sizeAndTags = __atomic_load_n(&block->size_and_tags, __ATOMIC_RELAXED);
+    return (sizeAndTags & (TAG_MMAPPED | TAG_USED)) == (TAG_MMAPPED | TAG_USED);
+}
+
+// Unmap the mmapped chunk 'block', raising the mmap threshold if the chunk
+// was bigger than it. Needs no lock.
+static void mmap_chunk_free(block_info* block) {
+    size_t mapSize = SIZE(block->size_and_tags);
+    if(mapSize > __atomic_load_n(&mmap_threshold, __ATOMIC_RELAXED) && mapSize <= MMAP_THRESHOLD_MAX){
+        __atomic_store_n(&mmap_threshold, mapSize, __ATOMIC_RELAXED);
+        __atomic_store_n(&trim_threshold, 2 * mapSize, __ATOMIC_RELAXED);
+    }
+    munmap(mmap_chunk_start(block), mapSize);
+    mmap_count_bytes(-(ssize_t)mapSize);
+}
+
+// Calculate the block size needed for a payload of 'size' bytes, taking into
+// account alignment and overhead.
+static size_t adjusted_block_size(size_t size) {
+    size += TAG_SIZE;
+    if(size <= MIN_BLOCK_SIZE) {
+        return MIN_BLOCK_SIZE;
+    }
+    return ALIGNMENT * ((size + ALIGNMENT - 1) / ALIGNMENT);
+}
+
+// Allocate a block of reqSize bytes whose payload is aligned to 'alignment'
+// (a power of two larger than ALIGNMENT), carving it out of the middle of a
+// free block. The leading slack becomes a free block of its own. Returns
+// NULL if the heap can't grow enough.
+static block_info* allocate_aligned_block(size_t alignment, size_t reqSize) {
+    // Enough for the block, the worst-case misalignment and a leading free
+    // block of at least MIN_BLOCK_SIZE
+    block_info *ptrFreeBlock = find_free_block(reqSize + alignment + MIN_BLOCK_SIZE);
+    if(ptrFreeBlock == NULL){
+        return NULL;
+    }
+
+    // Find the first aligned payload that leaves either no slack or enough
+    // slack for a free block before it
+    uintptr_t payload = ((uintptr_t)ptrFreeBlock + TAG_SIZE + alignment - 1) & ~(uintptr_t)(alignment - 1);
+    size_t leadSize = payload - TAG_SIZE - (uintptr_t)ptrFreeBlock;
+    while(leadSize != 0 && leadSize < MIN_BLOCK_SIZE){
+        payload += alignment;
+        leadSize += alignment;
+    }
+    if(leadSize == 0){
+        split_free_block(ptrFreeBlock, reqSize);
+        return ptrFreeBlock;
+    }
+
+    // Both pieces are carved from this block, so they are zero if it is
+    size_t freeTags = ptrFreeBlock->size_and_tags;
+    size_t zeroed = freeTags & TAG_ZEROED;
+    size_t restSize = SIZE(freeTags) - leadSize;
+    size_t stamp = restSize >= PURGE_MIN_SIZE ? *dirty_stamp(ptrFreeBlock) : 0;
+    remove_free_block(ptrFreeBlock);
+
+    // The leading slack keeps the free block's place after a used block
+    putSizeAndTags(ptrFreeBlock, leadSize | (freeTags & TAG_PRECEDING_USED) | zeroed);
+    insert_free_block(ptrFreeBlock);
+
+    // The rest is a free block preceded by a free block until it is split
+    block_info *alignedBlock = (block_info*)UNSCALED_POINTER_SUB((void*)payload, TAG_SIZE);
+    putSizeAndTags(alignedBlock, restSize | zeroed);
+    if(restSize >= PURGE_MIN_SIZE){
+        *dirty_stamp(alignedBlock) = stamp;
+    }
+    insert_free_block(alignedBlock);
+    split_free_block(alignedBlock, reqSize);
+    return alignedBlock;
+}
+
+// Map a chunk of its own for a payload of 'size' bytes aligned to
+// 'alignment', for when locked_arena's heap can't grow. Blocks small enough
+// for the caches are refused, as mm_free_sized files those in a cache
+// without reading their header. Returns the payload, or NULL.
+static void* mmap_chunk_fallback(size_t size, size_t alignment) {
+    if(adjusted_block_size(size) <= TCACHE_MAX_SIZE){
+        return NULL;
+    }
+    block_info *chunk = mmap_chunk_alloc(size, alignment);
+    return chunk != NULL ? UNSCALED_POINTER_ADD(chunk, TAG_SIZE) : NULL;
+}
+
+// The main malloc function. Returns NULL if size is zero or too large, or if
+// there is no memory for it. Called with locked_arena's lock held.
+static void* heap_malloc (size_t size) {
+    // If size is 0 (or more than can be served), return NULL
+    if (size == 0 || size > MAX_REQUEST_SIZE) {
+        return NULL;
+    }
+
+    // Give huge requests a mapping of their own
+    if (size >= __atomic_load_n(&mmap_threshold, __ATOMIC_RELAXED)) {
+        block_info *chunk = mmap_chunk_alloc(size, ALIGNMENT);
+        if (chunk != NULL) {
+            return UNSCALED_POINTER_ADD(chunk, TAG_SIZE);
+        }
+    }
+
+    // Calculate the required size, taking into account alignment and overhead
+    size_t reqSize = adjusted_block_size(size);
+
+    // Find a suitable block and handle the splitting or using of it
+    block_info *ptrFreeBlock = allocate_block(reqSize);
+    if (ptrFreeBlock == NULL) {
+        return mmap_chunk_fallback(size, ALIGNMENT);
+    }
+    // Return a pointer to the allocated memory
+    return UNSCALED_POINTER_ADD(ptrFreeBlock, TAG_SIZE);
+}
+
+/*
+ * Allocate a block of size bytes whose address is a multiple of alignment,
+ * which must be a power of two. Returns NULL if size is zero or too large, or
+ * if there is no memory for it. Called with locked_arena's lock held.
+ */
+static void* heap_memalign (size_t alignment, size_t size) {
+    if (alignment <= ALIGNMENT) {
+        return heap_malloc(size);
+    }
+    if (size == 0 || alignment > MAX_REQUEST_SIZE || size > MAX_REQUEST_SIZE - alignment) {
+        return NULL;
+    }
+    if (size >= __atomic_load_n(&mmap_threshold, __ATOMIC_RELAXED)) {
+        block_info *chunk = mmap_chunk_alloc(size, alignment);
+        if (chunk != NULL) {
+            return UNSCALED_POINTER_ADD(chunk, TAG_SIZE);
+        }
+    }
+
+    block_info *alignedBlock = allocate_aligned_block(alignment, adjusted_block_size(size));
+    if (alignedBlock == NULL) {
+        return mmap_chunk_fallback(size, alignment);
+    }
+    return UNSCALED_POINTER_ADD(alignedBlock, TAG_SIZE);
+}
+
+/*
+ * Allocate zero-initialized space for size bytes. Returns NULL if size is
+ * zero or too large, or if there is no memory for it. Called with
+ * locked_arena's lock held.
+ */
+static void* heap_calloc (size_t size) {
+    if (size == 0 || size > MAX_REQUEST_SIZE) {
+        return NULL;
+    }
+
+    // Fresh mappings are already zero
+    if (size >= __atomic_load_n(&mmap_threshold, __ATOMIC_RELAXED)) {
+        block_info *chunk = mmap_chunk_alloc(size, ALIGNMENT);
+        if (chunk != NULL) {
+            return UNSCALED_POINTER_ADD(chunk, TAG_SIZE);
+        }
+    }
+
+    size_t reqSize = adjusted_block_size(size);
+    block_info *ptrFreeBlock = find_free_block(reqSize);
+    if (ptrFreeBlock == NULL) {
+        // Fresh mappings are zero here too
+        return mmap_chunk_fallback(size, ALIGNMENT);
+    }
+    size_t zeroed = ptrFreeBlock->size_and_tags & TAG_ZEROED;
+    split_free_block(ptrFreeBlock, reqSize);
+
+    void *payload = UNSCALED_POINTER_ADD(ptrFreeBlock, TAG_SIZE);
+    size_t payloadSize = SIZE(ptrFreeBlock->size_and_tags) - TAG_SIZE;
+    if (!zeroed || payloadSize <= 2 * sizeof(block_link) + TAG_SIZE) {
+        memset(payload, 0, payloadSize);
+    } else {
+        // Only the old next/prev links and, if the block wasn't split, the
+        // last tag (its old footer) can be dirty
+        memset(payload, 0, 2 * sizeof(block_link));
+        *(tag_t*)UNSCALED_POINTER_ADD(payload, payloadSize - TAG_SIZE) = 0;
+    }
+    return payload;
+}
+
+/*
+ * Allocate n (> 0) blocks of size (> 0) bytes each into ptrs. The blocks are
+ * carved one after another out of a single free block, so the search and
+ * split happen once; the last block also gets any slack the split leaves.
+ * Returns the number of blocks allocated, which is less than n only if
+ * memory ran out. Called with locked_arena's lock held.
+ */
+static size_t heap_malloc_batch (size_t size, size_t n, void **ptrs) {
+    size_t reqSize = adjusted_block_size(size);
+
+    // Huge blocks get mappings of their own. The blocks are only carved out
+    // of one free block if their total is below the mmap threshold too, which
+    // keeps it far below MAX_REQUEST_SIZE (and a compact heap's tag limit);
+    // bigger batches are allocated one block at a time.
+    size_t threshold = __atomic_load_n(&mmap_threshold, __ATOMIC_RELAXED);
+    block_info *block = NULL;
+    if (size < threshold && reqSize <= threshold / n) {
+        block = find_free_block(n * reqSize);
+    }
+    if (block == NULL) {
+        for (size_t i = 0; i < n; i++) {
+            if ((ptrs[i] = heap_malloc(size)) == NULL) {
+                return i;
+            }
+        }
+        return n;
+    }
+    split_free_block(block, n * reqSize);
+    size_t totalSize = SIZE(block->size_and_tags);
+    size_t tags = block->size_and_tags & TAG_PRECEDING_USED;
+    for (size_t i = 0; i < n; i++) {
+        size_t blockSize = i + 1 < n ? reqSize : totalSize - (n - 1) * reqSize;
+        putTags(block, blockSize | TAG_USED | tags);
+        ptrs[i] = UNSCALED_POINTER_ADD(block, TAG_SIZE);
+        block = (block_info*) UNSCALED_POINTER_ADD(block, blockSize);
+        tags = TAG_PRECEDING_USED;
+    }
+    return n;
+}
+
+
+
+
+/*
+ * Free the block referenced by ptr, which must belong to locked_arena (or be
+ * an mmapped chunk). Called with locked_arena's lock held.
+ */
+static void heap_free(void *ptr) {
+    if(ptr == NULL){
         return;
     }
-    
-    block_info * blockInfo  = ptr - WORD_SIZE;
-    if(!(blockInfo -> size_and_tags & TAG_USED)){
+    block_info * blockInfo  = ptr - TAG_SIZE;
+
+    // Anything outside the heap can only be an mmapped chunk
+    if(ptr<heap_lo() || ptr>heap_hi()){
+        if((blockInfo->size_and_tags & (TAG_MMAPPED | TAG_USED)) == (TAG_MMAPPED | TAG_USED)){
+            mmap_chunk_free(blockInfo);
+        }
         return;
     }
 
-    clearTag(blockInfo, TAG_USED);
+    if(!(blockInfo -> size_and_tags & TAG_USED)){
+        return;
+    }
 
-    block_info * followingBlock = (block_info *)UNSCALED_POINTER_ADD(blockInfo, SIZE(blockInfo->size_and_tags));
-    if(followingBlock < mem_heap_hi()){
-        clearTag(followingBlock, TAG_PRECEDING_USED);
+    // Small blocks wait in the fast bins, still marked used
+    size_t size = SIZE(blockInfo->size_and_tags);
+    if(size <= FASTBIN_MAX_SIZE){
+        struct arena *arena = locked_arena;
+        int bin = (size - MIN_BLOCK_SIZE) / ALIGNMENT;
+        *(void**)ptr = arena->fastbins[bin];
+        arena->fastbins[bin] = ptr;
+        arena->fastbin_bytes += size;
+        if(arena->fastbin_bytes > FASTBIN_MAX_BYTES){
+            heap_consolidate();
+        }
+        return;
     }
-  
-    insert_free_block(blockInfo);
-    coalesce_free_block(blockInfo);
+    heap_free_block(blockInfo);
 }
 
-void clearTag(block_info *block, size_t tag) {
-    putSizeAndTags(block, block->size_and_tags & (~tag));
+/*
+ * Free the used blocks at 'payloads', which are sorted by address and owned
+ * by locked_arena. Each run of blocks that are adjacent in memory is first
+ * merged into one used block, so that it is coalesced and filed once.
+ * Called with locked_arena's lock held.
+ */
+static void heap_free_sorted(void **payloads, size_t count) {
+    size_t i = 0;
+    while(i < count){
+        void *ptr = payloads[i++];
+        if(ptr < heap_lo() || ptr > heap_hi()){
+            heap_free(ptr);
+            continue;
+        }
+        block_info *first = (block_info*)UNSCALED_POINTER_SUB(ptr, TAG_SIZE);
+        size_t sizeAndTags = first->size_and_tags;
+        if(!(sizeAndTags & TAG_USED)){
+            continue;
+        }
+
+        size_t runSize = SIZE(sizeAndTags);
+        while(i < count){
+            block_info *next = (block_info*)UNSCALED_POINTER_ADD(first, runSize);
+            if(payloads[i] != UNSCALED_POINTER_ADD(next, TAG_SIZE) || !(next->size_and_tags & TAG_USED)){
+                break;
+            }
+            runSize += SIZE(next->size_and_tags);
+            i++;
+        }
+        first->size_and_tags = runSize | (sizeAndTags & (ALIGNMENT - 1));
+        heap_free(ptr);
+    }
 }
 
 /*
- * A heap consistency checker. Optional, but recommended to help you debug
- * potential issues with your allocator.
+ * Free every block other threads have queued on locked_arena. Called with
+ * locked_arena's lock held.
  */
-int mm_check() {
-  // TODO: Implement a heap consistency checker as needed/desired.
-  return 0;
+static void heap_drain_remote_frees() {
+    struct arena *arena = locked_arena;
+    if(__atomic_load_n(&arena->remote_frees, __ATOMIC_RELAXED) == NULL){
+        return;
+    }
+    void *payload = __atomic_exchange_n(&arena->remote_frees, NULL, __ATOMIC_ACQUIRE);
+    while(payload != NULL){
+        void *next = *(void**)payload;
+        heap_free(payload);
+        payload = next;
+    }
+}
+
+/*
+ * Purge every free block that has been dirty for at least 'decay_ms'
+ * milliseconds; a negative 'decay_ms' purges every dirty block. Returns the
+ * number of bytes purged.
+ */
+size_t mm_purge(long decay_ms) {
+    size_t released = 0;
+    unsigned int count = __atomic_load_n(&num_arenas, __ATOMIC_ACQUIRE);
+    for(unsigned int i = 0; i < count; i++){
+        arena_lock(arenas[i]);
+        released += purge_dirty_blocks(now_ms(), decay_ms < 0 ? 0 : decay_ms);
+        arena_unlock(arenas[i]);
+    }
+    return released;
+}
+
+/*
+ * Set how long a free block may stay dirty before mm_free purges it. A
+ * negative value turns automatic purging off.
+ */
+void mm_set_purge_decay(long decay_ms) {
+    __atomic_store_n(&purge_decay_ms, decay_ms, __ATOMIC_RELAXED);
+}
+
+// Report the total number of bytes given back with madvise.
+size_t mm_purged_bytes() {
+    size_t bytes = 0;
+    unsigned int count = __atomic_load_n(&num_arenas, __ATOMIC_ACQUIRE);
+    for(unsigned int i = 0; i < count; i++){
+        arena_lock(arenas[i]);
+        bytes += arenas[i]->purged_bytes;
+        arena_unlock(arenas[i]);
+    }
+    return bytes;
+}
+
+/*
+ * Configure how the heap grows: each extension is at least 'minChunk' bytes
+ * and otherwise 'percent' percent of the current heap size, capped at
+ * 'maxChunk' bytes (requests bigger than that still get what they need).
+ * On heaps that can be trimmed the cap is also held to half the trim
+ * threshold, so that an extension isn't given straight back: 128 KiB at
+ * first, rising as the mmap and trim thresholds adapt. It no longer applies
+ * to the main arena once memlib has refused to shrink its heap.
+ */
+void mm_set_growth_policy(size_t minChunk, size_t percent, size_t maxChunk) {
+    __atomic_store_n(&growth_min_chunk, minChunk, __ATOMIC_RELAXED);
+    __atomic_store_n(&growth_percent, percent, __ATOMIC_RELAXED);
+    __atomic_store_n(&growth_max_chunk, maxChunk, __ATOMIC_RELAXED);
+}
+
+
+// Shrink the used block 'block' to 'newSize' bytes, returning the tail to the
+// free list if it is big enough to be a block of its own.
+static void shrink_used_block(block_info* block, size_t newSize) {
+    size_t leftSize = SIZE(block->size_and_tags) - newSize;
+    if(leftSize < MIN_BLOCK_SIZE){
+        return;
+    }
+
+    // Keep the block's own tags, but with the smaller size
+    block->size_and_tags = newSize | (block->size_and_tags & (ALIGNMENT - 1));
+    heap_count_in_use(-(ssize_t)leftSize);
+
+    // The tail becomes a free block preceded by a used one
+    block_info *tail = (block_info*)UNSCALED_POINTER_ADD(block, newSize);
+    putSizeAndTags(tail, leftSize | TAG_PRECEDING_USED);
+    if(leftSize >= PURGE_MIN_SIZE){
+        *dirty_stamp(tail) = now_ms();
+    }
+
+    // The block following the tail is now preceded by a free block
+    block_info *followingBlock = (block_info*)UNSCALED_POINTER_ADD(tail, leftSize);
+    clearTag(followingBlock, TAG_PRECEDING_USED);
+
+    insert_free_block(tail);
+    coalesce_free_block(tail);
+}
+
+// Try to grow the used block 'block' to at least 'reqSize' bytes without
+// moving it, by absorbing the following free block and, if the block sits at
+// the end of the heap, by extending the heap. Returns true on success.
+static bool grow_used_block(block_info* block, size_t reqSize) {
+    size_t curSize = SIZE(block->size_and_tags);
+    block_info *followingBlock = (block_info*)UNSCALED_POINTER_ADD(block, curSize);
+    size_t available = curSize;
+
+    if(!(followingBlock->size_and_tags & TAG_USED)){
+        available += SIZE(followingBlock->size_and_tags);
+    }
+    if(available < reqSize){
+        // Only blocks at the end of the heap (possibly followed by a free
+        // block) can grow by extending it.
+        block_info *afterFree = (block_info*)UNSCALED_POINTER_ADD(block, available);
+        if(SIZE(afterFree->size_and_tags) != 0){
+            return false;
+        }
+        // The new space coalesces with the following free block, if any.
+        if(!request_more_space(reqSize - curSize)){
+            return false;
+        }
+        followingBlock = (block_info*)UNSCALED_POINTER_ADD(block, curSize);
+        available = curSize + SIZE(followingBlock->size_and_tags);
+    }
+
+    // Absorb the following free block
+    remove_free_block(followingBlock);
+    block->size_and_tags = available | (block->size_and_tags & (ALIGNMENT - 1));
+    heap_count_in_use(available - curSize);
+    setTag((block_info*)UNSCALED_POINTER_ADD(block, available), TAG_PRECEDING_USED);
+
+    // Give back whatever is not needed
+    shrink_used_block(block, reqSize);
+    return true;
+}
+
+// Resize the mmapped chunk 'block' to hold 'size' bytes. Chunks that stay
+// above the mmap threshold are resized with mremap, which keeps the payload's
+// offset within its page; smaller ones move into the heap.
+static void* realloc_mmap_chunk(block_info* block, size_t size) {
+    void *ptr = UNSCALED_POINTER_ADD(block, TAG_SIZE);
+    char *start = mmap_chunk_start(block);
+    size_t mapSize = SIZE(block->size_and_tags);
+    size_t usable = start + mapSize - (char*)ptr;
+
+    if(size >= __atomic_load_n(&mmap_threshold, __ATOMIC_RELAXED)){
+        size_t pagesize = mem_pagesize();
+        size_t offset = (char*)ptr - start;
+        size_t newMapSize = (offset + size + pagesize - 1) & ~(pagesize - 1);
+        // The old mapping is gone once mremap moves it
+        size_t tags = block->size_and_tags & (ALIGNMENT - 1);
+        char *newStart = mremap(start, mapSize, newMapSize, MREMAP_MAYMOVE);
+        if(newStart != MAP_FAILED){
+            block_info *newBlock = (block_info*)(newStart + offset - TAG_SIZE);
+            newBlock->size_and_tags = newMapSize | tags;
+            mmap_count_bytes(newMapSize - mapSize);
+            if(newStart == start){
+                locked_arena->realloc_in_place_count++;
+            }
+            return newStart + offset;
+        }
+    }
+
+    void *newPtr = heap_malloc(size);
+    if(newPtr != NULL){
+        memcpy(newPtr, ptr, size < usable ? size : usable);
+        heap_free(ptr);
+    }
+    return newPtr;
+}
+
+/*
+ * Resize the used block referenced by ptr to hold at least size (> 0) bytes,
+ * keeping its contents up to the smaller of the old and new sizes. Resizes in
+ * place when possible and otherwise moves the block. Returns NULL, leaving
+ * the block alone, if size is more than MAX_REQUEST_SIZE. Called with the
+ * lock of the arena owning the block (any arena for mmapped chunks) held.
+ */
+static void* heap_realloc(void *ptr, size_t size) {
+    if(size > MAX_REQUEST_SIZE){
+        return NULL;
+    }
+    block_info *blockInfo = (block_info*)UNSCALED_POINTER_SUB(ptr, TAG_SIZE);
+    size_t curSize = SIZE(blockInfo->size_and_tags);
+    size_t reqSize = adjusted_block_size(size);
+    struct arena *arena = locked_arena;
+    arena->realloc_count++;
+
+    if(blockInfo->size_and_tags & TAG_MMAPPED){
+        return realloc_mmap_chunk(blockInfo, size);
+    }
+
+    // Shrinking (or a size that already fits) never moves the block
+    if(reqSize <= curSize){
+        shrink_used_block(blockInfo, reqSize);
+        arena->realloc_in_place_count++;
+        return ptr;
+    }
+
+    if(grow_used_block(blockInfo, reqSize)){
+        arena->realloc_in_place_count++;
+        return ptr;
+    }
+
+    // Fall back to moving the block
+    void *newPtr = heap_malloc(size);
+    if(newPtr != NULL){
+        memcpy(newPtr, ptr, curSize - TAG_SIZE);
+        heap_free(ptr);
+    }
+    return newPtr;
+}
+
+// Report how many mm_realloc calls resized a block and how many of those
+// were done in place.
+void mm_realloc_counts(size_t *calls, size_t *inPlace) {
+    *calls = 0;
+    *inPlace = 0;
+    unsigned int count = __atomic_load_n(&num_arenas, __ATOMIC_ACQUIRE);
+    for(unsigned int i = 0; i < count; i++){
+        arena_lock(arenas[i]);
+        *calls += arenas[i]->realloc_count;
+        *inPlace += arenas[i]->realloc_in_place_count;
+        arena_unlock(arenas[i]);
+    }
+}
+
+
+// THREAD CACHES ----------------------------------------------------
+
+// A thread's cache, and the arena it allocates from. Blocks in a bin are used
+// blocks of exactly that bin's size, linked through the first word of their
+// payload, and may belong to any arena.
+struct tcache {
+    // Value of heap_generation when the cached blocks were taken; mm_init
+    // starts a new heap and so invalidates every cache.
+    unsigned long generation;
+    // Whether the exit destructor has been registered (and an arena
+    // assigned) for this thread.
+    bool registered;
+    struct arena *arena;
+    // Goes up each time the arena's lock is found taken and down each time it
+    // is free; see thread_arena_lock.
+    unsigned int contention;
+    // Blocks queued on other arenas since this thread last drained one.
+    unsigned int remote_frees;
+    void *bins[TCACHE_NUM_BINS];
+    unsigned int counts[TCACHE_NUM_BINS];
+    // Bins of slab objects, one per slab class, linked the same way.
+    void *slab_bins[SLAB_NUM_CLASSES];
+    unsigned int slab_counts[SLAB_NUM_CLASSES];
+    // Mallocs and frees not yet added to the totals; see STATISTICS above.
+    size_t malloc_count;
+    size_t free_count;
+};
+
+static __thread struct tcache thread_cache;
+static pthread_key_t tcache_key;
+static pthread_once_t tcache_key_once = PTHREAD_ONCE_INIT;
+
+// Returns the bin for blocks of blockSize (<= TCACHE_MAX_SIZE) bytes.
+static inline int tcache_bin(size_t blockSize) {
+    return (blockSize - MIN_BLOCK_SIZE) / ALIGNMENT;
+}
+
+static inline void tcache_push(struct tcache *tc, int bin, void *payload) {
+    *(void**)payload = tc->bins[bin];
+    tc->bins[bin] = payload;
+    tc->counts[bin]++;
+}
+
+static inline void* tcache_pop(struct tcache *tc, int bin) {
+    void *payload = tc->bins[bin];
+    tc->bins[bin] = *(void**)payload;
+    tc->counts[bin]--;
+    return payload;
+}
+
+/*
+ * Queue the used block at 'payload', owned by 'arena' (not this thread's), to
+ * be freed by the next thread that locks the arena. The queue is only ever
+ * taken as a whole, so a push is a single CAS with no ABA problem.
+ */
+static void arena_remote_free(struct tcache *tc, struct arena* arena, void *payload) {
+    void **link = payload;
+    void *head = __atomic_load_n(&arena->remote_frees, __ATOMIC_RELAXED);
+    do {
+        *link = head;
+    } while(!__atomic_compare_exchange_n(&arena->remote_frees, &head, payload, true,
+                                         __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+    // An arena that isn't allocating never drains its queue, so a thread that
+    // keeps freeing remotely does it now and then. The caller may hold its
+    // own arena's lock, so only try for this one.
+    if(++tc->remote_frees >= REMOTE_FREE_LIMIT && pthread_mutex_trylock(&arena->lock) == 0){
+        tc->remote_frees = 0;
+        struct arena *held = locked_arena;
+        locked_arena = arena;
+        heap_drain_remote_frees();
+        locked_arena = held;
+        arena_unlock(arena);
+    }
+}
+
+// Give the 'count' used blocks at 'payloads' back to their arenas. Only the
+// arena of this thread (owning 'tc') is locked; blocks of other arenas go on
+// their remote-free queues.
+static void release_blocks(struct tcache *tc, void **payloads, unsigned int count) {
+    bool locked = false;
+    for(unsigned int i = 0; i < count; i++){
+        void *payload = payloads[i];
+        struct arena *owner = arena_of(payload);
+        if(owner != tc->arena){
+            arena_remote_free(tc, owner, payload);
+            continue;
+        }
+        if(!locked){
+            arena_lock(owner);
+            locked = true;
+        }
+        heap_free(payload);
+    }
+    if(locked){
+        arena_unlock(tc->arena);
+    }
+}
+
+// Give 'count' blocks from 'bin' back to their arenas.
+static void tcache_flush(struct tcache *tc, int bin, unsigned int count) {
+    void *payloads[TCACHE_BIN_CAPACITY];
+    for(unsigned int i = 0; i < count; i++){
+        payloads[i] = tcache_pop(tc, bin);
+    }
+    release_blocks(tc, payloads, count);
+}
+
+// Give 'count' objects from the slab bin for class 'cls' back to their
+// pages.
+static void tcache_flush_slab(struct tcache *tc, int cls, unsigned int count) {
+    void *objects[TCACHE_BIN_CAPACITY];
+    for(unsigned int i = 0; i < count; i++){
+        objects[i] = tc->slab_bins[cls];
+        tc->slab_bins[cls] = *(void**)objects[i];
+    }
+    tc->slab_counts[cls] -= count;
+    slab_free_objects(objects, count);
+}
+
+// Give every block in the cache back to its arena, and every slab object to
+// its page.
+static void tcache_flush_all(struct tcache *tc) {
+    for(size_t bin = 0; bin < TCACHE_NUM_BINS; bin++){
+        tcache_flush(tc, bin, tc->counts[bin]);
+    }
+    for(int cls = 0; cls < SLAB_NUM_CLASSES; cls++){
+        tcache_flush_slab(tc, cls, tc->slab_counts[cls]);
+    }
+}
+
+// Add the mallocs and frees 'tc' has counted to the totals.
+static void stats_flush_thread(struct tcache *tc) {
+    __atomic_add_fetch(&stats_malloc_count, tc->malloc_count, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&stats_free_count, tc->free_count, __ATOMIC_RELAXED);
+    tc->malloc_count = 0;
+    tc->free_count = 0;
+}
+
+// Count 'n' mallocs / frees by this thread.
+static inline void stats_count_mallocs(size_t n) {
+    struct tcache *tc = &thread_cache;
+    tc->malloc_count += n;
+    if(tc->malloc_count >= STATS_FLUSH_INTERVAL){
+        stats_flush_thread(tc);
+    }
+}
+
+static inline void stats_count_frees(size_t n) {
+    struct tcache *tc = &thread_cache;
+    tc->free_count += n;
+    if(tc->free_count >= STATS_FLUSH_INTERVAL){
+        stats_flush_thread(tc);
+    }
+}
+
+// Thread-exit destructor: return the exiting thread's cache to the heap and
+// give up its place in its arena. A later destructor of the same thread that
+// allocates or frees registers the cache again, so that this runs again on
+// the next destructor pass rather than leaving those blocks cached.
+static void tcache_destroy(void *arg) {
+    struct tcache *tc = arg;
+    if(tc->generation == heap_generation){
+        tcache_flush_all(tc);
+    }
+    stats_flush_thread(tc);
+    arena_release(tc->arena);
+    tc->registered = false;
+}
+
+static void tcache_create_key() {
+    pthread_key_create(&tcache_key, tcache_destroy);
+}
+
+// Returns this thread's cache, emptied if it belongs to an earlier heap.
+static inline struct tcache* tcache_get() {
+    struct tcache *tc = &thread_cache;
+    if(tc->generation != heap_generation){
+        // Blocks from before mm_init no longer exist
+        memset(tc->bins, 0, sizeof(tc->bins));
+        memset(tc->counts, 0, sizeof(tc->counts));
+        memset(tc->slab_bins, 0, sizeof(tc->slab_bins));
+        memset(tc->slab_counts, 0, sizeof(tc->slab_counts));
+        tc->generation = heap_generation;
+    }
+    if(!tc->registered){
+        pthread_once(&tcache_key_once, tcache_create_key);
+        pthread_setspecific(tcache_key, tc);
+        tc->arena = arena_assign();
+        tc->registered = true;
+    }
+    return tc;
+}
+
+// Lock the arena of the thread owning 'tc' to allocate from it, and return
+// it. Blocks other threads have queued on the arena are freed first. A thread
+// that has recently found the lock taken more often than not (by
+// ARENA_CONTENTION_LIMIT) moves to a less loaded arena for its next
+// allocation.
+static struct arena* thread_arena_lock(struct tcache *tc) {
+    struct arena *arena = tc->arena;
+    if(!arena_lock(arena)){
+        if(tc->contention > 0){
+            tc->contention--;
+        }
+    } else if(++tc->contention >= ARENA_CONTENTION_LIMIT){
+        tc->contention = 0;
+        tc->arena = arena_rebalance(arena);
+    }
+    heap_drain_remote_frees();
+    return arena;
+}
+
+// Allocate a single block of reqSize (<= TCACHE_MAX_SIZE) bytes from the
+// main arena, for a thread whose own arena 'full' can't grow. Returns NULL if
+// the main arena can't either.
+static void* main_arena_malloc(struct arena *full, size_t reqSize) {
+    if(full == &main_arena){
+        return NULL;
+    }
+    arena_lock(&main_arena);
+    block_info *block = allocate_block(reqSize);
+    arena_unlock(&main_arena);
+    return block != NULL ? UNSCALED_POINTER_ADD(block, TAG_SIZE) : NULL;
+}
+
+// Allocate a block of reqSize (<= TCACHE_MAX_SIZE) bytes for this thread,
+// refilling its bin from the heap if it is empty. If the thread's arena can't
+// grow, the block comes from the main arena (see main_arena_malloc).
+static void* tcache_malloc(size_t reqSize) {
+    struct tcache *tc = tcache_get();
+    int bin = tcache_bin(reqSize);
+    if(tc->counts[bin] > 0){
+        return tcache_pop(tc, bin);
+    }
+
+    // Take a batch of blocks in one trip to the heap. Splitting may hand back
+    // a slightly larger block, which is filed under its own size.
+    struct arena *arena = thread_arena_lock(tc);
+    block_info *first = allocate_block(reqSize);
+    if(first == NULL){
+        arena_unlock(arena);
+        return main_arena_malloc(arena, reqSize);
+    }
+    for(int i = 1; i < TCACHE_REFILL; i++){
+        block_info *block = allocate_block(reqSize);
+        if(block == NULL){
+            break;
+        }
+        void *payload = UNSCALED_POINTER_ADD(block, TAG_SIZE);
+        int blockBin = tcache_bin(SIZE(block->size_and_tags));
+        if(blockBin < (int) TCACHE_NUM_BINS && tc->counts[blockBin] < TCACHE_BIN_CAPACITY){
+            tcache_push(tc, blockBin, payload);
+        } else {
+            heap_free(payload);
+        }
+    }
+    arena_unlock(arena);
+    return UNSCALED_POINTER_ADD(first, TAG_SIZE);
+}
+
+// Cache the used block at 'payload' of blockSize (<= TCACHE_MAX_SIZE) bytes,
+// flushing part of its bin to the heap if the bin is full.
+static void tcache_free(void *payload, size_t blockSize) {
+    struct tcache *tc = tcache_get();
+    int bin = tcache_bin(blockSize);
+    if(tc->counts[bin] >= TCACHE_BIN_CAPACITY){
+        tcache_flush(tc, bin, TCACHE_FLUSH);
+    }
+    tcache_push(tc, bin, payload);
+}
+
+// Allocate a slab object of size (<= SLAB_MAX_SIZE) bytes for this thread,
+// refilling its bin from the slab if it is empty. Returns NULL if the slab
+// region is used up.
+static void* slab_malloc(size_t size) {
+    struct tcache *tc = tcache_get();
+    int cls = slab_size_class(size);
+    if(tc->slab_counts[cls] == 0){
+        void *objects[TCACHE_REFILL];
+        size_t count = slab_alloc(cls, objects, TCACHE_REFILL);
+        if(count == 0){
+            return NULL;
+        }
+        for(size_t i = 1; i < count; i++){
+            *(void**)objects[i] = tc->slab_bins[cls];
+            tc->slab_bins[cls] = objects[i];
+        }
+        tc->slab_counts[cls] += count - 1;
+        return objects[0];
+    }
+    void *object = tc->slab_bins[cls];
+    tc->slab_bins[cls] = *(void**)object;
+    tc->slab_counts[cls]--;
+    return object;
+}
+
+// Cache the slab object at 'ptr' of class 'cls' for this thread, flushing
+// part of its bin to the slab if the bin is full.
+static void slab_free(void *ptr, int cls) {
+    struct tcache *tc = tcache_get();
+    if(tc->slab_counts[cls] >= TCACHE_BIN_CAPACITY){
+        tcache_flush_slab(tc, cls, TCACHE_FLUSH);
+    }
+    *(void**)ptr = tc->slab_bins[cls];
+    tc->slab_bins[cls] = ptr;
+    tc->slab_counts[cls]++;
+}
+
+
+#if PERCPU_CACHE
+// PER-CPU CACHES ---------------------------------------------------
+
+#include <sys/rseq.h>
+
+// Outcomes of a push or pop. An aborted one was interrupted (the thread was
+// preempted, migrated or signalled) and should be retried; a refused one
+// found the bin empty (pop) or full (push).
+#define PERCPU_DONE 0
+#define PERCPU_ABORTED 1
+#define PERCPU_REFUSED 2
+
+// The signature the C library registered rseq with, which has to precede
+// every abort handler.
+_Static_assert(RSEQ_SIG == 0x53053053, "unexpected rseq signature");
+
+/*
+ * The start of a restartable sequence: emits its descriptor (from local
+ * label 1 to label 2, aborting to label 4, which jumps to the C label
+ * 'abort_label') and points the rseq area's rseq_cs at it. The sequence must
+ * end with its one committing store immediately before label 2.
+ */
+#define PERCPU_RSEQ_START(abort_label) \
+    ".pushsection __rseq_cs, \"aw\"\n\t" \
+    ".balign 32\n\t" \
+    "3:\n\t" \
+    ".long 0x0, 0x0\n\t" \
+    ".quad 1f, (2f - 1f), 4f\n\t" \
+    ".popsection\n\t" \
+    ".pushsection __rseq_failure, \"ax\"\n\t" \
+    ".byte 0x0f, 0xb9, 0x3d\n\t" \
+    ".long 0x53053053\n\t" \
+    "4:\n\t" \
+    "jmp %l[" #abort_label "]\n\t" \
+    ".popsection\n\t" \
+    "leaq 3b(%%rip), %%rax\n\t" \
+    "movq %%rax, %c[cs_offset](%[rseq])\n\t" \
+    "1:\n\t" \
+    "cmpl %[cpu], %c[cpu_offset](%[rseq])\n\t" \
+    "jnz %l[" #abort_label "]\n\t"
+
+static void percpu_setup() {
+    long cpus = sysconf(_SC_NPROCESSORS_CONF);
+    if(cpus <= 0){
+        return;
+    }
+    void *map = mmap(NULL, cpus * sizeof(struct percpu_cache), PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(map != MAP_FAILED){
+        percpu_count = cpus;
+        percpu_caches = map;
+    }
+}
+
+// Returns this thread's rseq area if the per-CPU caches can be used, or NULL
+// if the thread has to fall back to its own cache.
+static inline struct rseq* percpu_rseq() {
+    if(__rseq_size == 0){
+        return NULL;
+    }
+    pthread_once(&percpu_once, percpu_setup);
+    struct rseq *rs = (struct rseq*)((char*)__builtin_thread_pointer() + __rseq_offset);
+    int cpu = (int)__atomic_load_n(&rs->cpu_id, __ATOMIC_RELAXED);
+    if(percpu_caches == NULL || cpu < 0 || cpu >= percpu_count){
+        return NULL;
+    }
+    return rs;
+}
+
+// Returns the bin 'bin' of the cache of the CPU the thread was last seen on,
+// and that CPU in '*cpu', or NULL if that CPU has no cache.
+static inline struct percpu_bin* percpu_bin(struct rseq *rs, int bin, int *cpu) {
+    *cpu = (int)__atomic_load_n(&rs->cpu_id_start, __ATOMIC_RELAXED);
+    if(*cpu >= percpu_count){
+        return NULL;
+    }
+    return &percpu_caches[*cpu].bins[bin];
+}
+
+// Pop a block from this CPU's bin 'bin' into '*payload'. The block is
+// stored through 'payload' before the commit (a store the sequence may
+// repeat), as asm goto outputs are not reliable across compilers.
+static inline int percpu_pop(struct rseq *rs, int bin, void **payload) {
+    int cpu;
+    struct percpu_bin *b = percpu_bin(rs, bin, &cpu);
+    if(b == NULL){
+        return PERCPU_REFUSED;
+    }
+    __asm__ goto (
+        PERCPU_RSEQ_START(aborted)
+        "movq (%[count]), %%rcx\n\t"
+        "testq %%rcx, %%rcx\n\t"
+        "jz %l[refused]\n\t"
+        "movq -8(%[slots], %%rcx, 8), %%rax\n\t"
+        "movq %%rax, (%[item])\n\t"
+        "decq %%rcx\n\t"
+        "movq %%rcx, (%[count])\n\t"
+        "2:\n\t"
+        :
+        : [rseq] "r" (rs), [cpu] "r" (cpu), [count] "r" (&b->count), [slots] "r" (b->slots),
+          [item] "r" (payload),
+          [cs_offset] "i" (offsetof(struct rseq, rseq_cs)),
+          [cpu_offset] "i" (offsetof(struct rseq, cpu_id))
+        : "rax", "rcx", "memory", "cc"
+        : aborted, refused);
+    return PERCPU_DONE;
+aborted:
+    return PERCPU_ABORTED;
+refused:
+    return PERCPU_REFUSED;
+}
+
+// Push the block at 'payload' onto this CPU's bin 'bin'.
+static inline int percpu_push(struct rseq *rs, int bin, void *payload) {
+    int cpu;
+    struct percpu_bin *b = percpu_bin(rs, bin, &cpu);
+    if(b == NULL){
+        return PERCPU_REFUSED;
+    }
+    __asm__ goto (
+        PERCPU_RSEQ_START(aborted)
+        "movq (%[count]), %%rcx\n\t"
+        "cmpq %[capacity], %%rcx\n\t"
+        "jae %l[refused]\n\t"
+        "movq %[item], (%[slots], %%rcx, 8)\n\t"
+        "incq %%rcx\n\t"
+        "movq %%rcx, (%[count])\n\t"
+        "2:\n\t"
+        :
+        : [rseq] "r" (rs), [cpu] "r" (cpu), [count] "r" (&b->count), [slots] "r" (b->slots),
+          [item] "r" (payload), [capacity] "i" (PERCPU_BIN_CAPACITY),
+          [cs_offset] "i" (offsetof(struct rseq, rseq_cs)),
+          [cpu_offset] "i" (offsetof(struct rseq, cpu_id))
+        : "rax", "rcx", "memory", "cc"
+        : aborted, refused);
+    return PERCPU_DONE;
+aborted:
+    return PERCPU_ABORTED;
+refused:
+    return PERCPU_REFUSED;
+}
+
+// Pop and push, retried until they are not interrupted. Return false if the
+// bin was empty or full.
+static inline bool percpu_pop_retry(struct rseq *rs, int bin, void **payload) {
+    int status;
+    while((status = percpu_pop(rs, bin, payload)) == PERCPU_ABORTED){
+    }
+    return status == PERCPU_DONE;
+}
+
+static inline bool percpu_push_retry(struct rseq *rs, int bin, void *payload) {
+    int status;
+    while((status = percpu_push(rs, bin, payload)) == PERCPU_ABORTED){
+    }
+    return status == PERCPU_DONE;
+}
+
+// Allocate a block of reqSize (<= TCACHE_MAX_SIZE) bytes from this CPU's
+// cache, refilling its bin from this thread's arena if it is empty, or from
+// the main arena if that can't grow.
+static void* percpu_malloc(struct rseq *rs, size_t reqSize) {
+    int bin = tcache_bin(reqSize);
+    void *payload;
+    if(percpu_pop_retry(rs, bin, &payload)){
+        return payload;
+    }
+
+    // As for the thread cache, but the blocks go to whichever CPU the thread
+    // is on by the time each is pushed
+    struct arena *arena = thread_arena_lock(tcache_get());
+    block_info *first = allocate_block(reqSize);
+    if(first == NULL){
+        arena_unlock(arena);
+        return main_arena_malloc(arena, reqSize);
+    }
+    for(int i = 1; i < TCACHE_REFILL; i++){
+        block_info *block = allocate_block(reqSize);
+        if(block == NULL){
+            break;
+        }
+        payload = UNSCALED_POINTER_ADD(block, TAG_SIZE);
+        int blockBin = tcache_bin(SIZE(block->size_and_tags));
+        if(blockBin >= (int) TCACHE_NUM_BINS || !percpu_push_retry(rs, blockBin, payload)){
+            heap_free(payload);
+        }
+    }
+    arena_unlock(arena);
+    return UNSCALED_POINTER_ADD(first, TAG_SIZE);
+}
+
+// Cache the used block at 'payload' of blockSize (<= TCACHE_MAX_SIZE) bytes
+// on this CPU. If the bin is full, part of it goes back to the heap along
+// with the block.
+static void percpu_free(struct rseq *rs, void *payload, size_t blockSize) {
+    int bin = tcache_bin(blockSize);
+    if(percpu_push_retry(rs, bin, payload)){
+        return;
+    }
+    void *payloads[TCACHE_FLUSH];
+    unsigned int count = 0;
+    payloads[count++] = payload;
+    while(count < TCACHE_FLUSH && percpu_pop_retry(rs, bin, &payloads[count])){
+        count++;
+    }
+    release_blocks(tcache_get(), payloads, count);
+}
+
+// Give every block cached on the calling thread's current CPU back to the
+// heap. Other CPUs' caches can only be touched from those CPUs.
+static void percpu_flush_current(struct rseq *rs) {
+    struct tcache *tc = tcache_get();
+    for(size_t bin = 0; bin < TCACHE_NUM_BINS; bin++){
+        void *payloads[PERCPU_BIN_CAPACITY];
+        unsigned int count = 0;
+        while(count < PERCPU_BIN_CAPACITY && percpu_pop_retry(rs, bin, &payloads[count])){
+            count++;
+        }
+        release_blocks(tc, payloads, count);
+    }
+}
+#endif
+
+
+// THREAD-SAFE ALLOCATOR INTERFACE ----------------------------------
+
+// Allocate a block of reqSize (<= TCACHE_MAX_SIZE) bytes from this CPU's
+// cache if there is one, and otherwise from this thread's.
+static inline void* cache_malloc(size_t reqSize) {
+#if PERCPU_CACHE
+    struct rseq *rs = percpu_rseq();
+    if (rs != NULL) {
+        return percpu_malloc(rs, reqSize);
+    }
+#endif
+    return tcache_malloc(reqSize);
+}
+
+// Cache the used block at 'payload', filing it as blockSize (<=
+// TCACHE_MAX_SIZE) bytes, on this CPU if it has a cache and otherwise on
+// this thread.
+static inline void cache_free(void *payload, size_t blockSize) {
+#if PERCPU_CACHE
+    struct rseq *rs = percpu_rseq();
+    if (rs != NULL) {
+        percpu_free(rs, payload, blockSize);
+        return;
+    }
+#endif
+    tcache_free(payload, blockSize);
+}
+
+/*
+ * Release free memory at the end of every arena's heap, keeping 'pad' bytes
+ * of each. The calling thread's cache is flushed first so its blocks don't
+ * pin the end of a heap. Returns 1 if any memory was released and 0
+ * otherwise.
+ */
+int mm_trim(size_t pad) {
+    tcache_flush_all(tcache_get());
+#if PERCPU_CACHE
+    struct rseq *rs = percpu_rseq();
+    if(rs != NULL){
+        percpu_flush_current(rs);
+    }
+#endif
+    size_t released = 0;
+    unsigned int count = __atomic_load_n(&num_arenas, __ATOMIC_ACQUIRE);
+    for(unsigned int i = 0; i < count; i++){
+        arena_lock(arenas[i]);
+        heap_drain_remote_frees();
+        heap_consolidate();
+        released += trim_heap_top(pad);
+        arena_unlock(arenas[i]);
+    }
+    return released != 0;
+}
+
+/*
+ * Allocate a block of size bytes and return a pointer to it. If size is zero
+ * or more than MAX_REQUEST_SIZE, returns NULL.
+ */
+void* mm_malloc (size_t size) {
+    // Checked before adjusted_block_size, which would wrap for sizes near
+    // SIZE_MAX and hand out a tiny block
+    if (size == 0 || size > MAX_REQUEST_SIZE) {
+        return NULL;
+    }
+    void *ptr = NULL;
+    if (size <= SLAB_MAX_SIZE) {
+        ptr = slab_malloc(size);
+    }
+    if (ptr == NULL) {
+        size_t reqSize = adjusted_block_size(size);
+        if (reqSize <= TCACHE_MAX_SIZE) {
+            ptr = cache_malloc(reqSize);
+        } else {
+            struct arena *arena = thread_arena_lock(tcache_get());
+            ptr = heap_malloc(size);
+            arena_unlock(arena);
+        }
+    }
+    if (ptr != NULL) {
+        stats_count_mallocs(1);
+    }
+    return ptr;
+}
+
+/* Free the block referenced by ptr. */
+void mm_free(void *ptr) {
+    if (ptr == NULL) {
+        return;
+    }
+    stats_count_frees(1);
+    if (is_slab(ptr)) {
+        slab_free(ptr, slab_size_class(slab_page_of(ptr)->size));
+        return;
+    }
+
+    // Small heap blocks go to this thread's cache (mmapped chunks are never
+    // this small). Other threads may be updating TAG_PRECEDING_USED in this
+    // header under its arena's lock, but never the size or TAG_USED.
+    block_info *blockInfo = (block_info*)UNSCALED_POINTER_SUB(ptr, TAG_SIZE);
+    size_t sizeAndTags = __atomic_load_n(&blockInfo->size_and_tags, __ATOMIC_RELAXED);
+    if ((sizeAndTags & TAG_USED) && SIZE(sizeAndTags) <= TCACHE_MAX_SIZE) {
+        cache_free(ptr, SIZE(sizeAndTags));
+        return;
+    }
+
+    // Mmapped chunks belong to no arena
+    if ((sizeAndTags & (TAG_MMAPPED | TAG_USED)) == (TAG_MMAPPED | TAG_USED)) {
+        mmap_chunk_free(blockInfo);
+        return;
+    }
+
+    // Blocks of other arenas are queued for their owner. Anything not in use
+    // is ignored, as queueing it would overwrite a free block's links.
+    struct tcache *tc = tcache_get();
+    struct arena *arena = arena_of(ptr);
+    if (arena != tc->arena) {
+        if (sizeAndTags & TAG_USED) {
+            arena_remote_free(tc, arena, ptr);
+        }
+        return;
+    }
+    arena_lock(arena);
+    heap_free(ptr);
+    arena_unlock(arena);
+}
+
+/*
+ * Returns the number of bytes the caller may use in the block referenced by
+ * ptr, which can be more than it asked for: blocks are rounded up to
+ * ALIGNMENT, a split never leaves a sliver smaller than MIN_BLOCK_SIZE, and
+ * mmapped chunks span whole pages. Returns 0 if ptr is NULL.
+ */
+size_t mm_usable_size(void *ptr) {
+    if (ptr == NULL) {
+        return 0;
+    }
+    if (is_slab(ptr)) {
+        return slab_page_of(ptr)->size;
+    }
+    block_info *blockInfo = (block_info*)UNSCALED_POINTER_SUB(ptr, TAG_SIZE);
+    size_t sizeAndTags = __atomic_load_n(&blockInfo->size_and_tags, __ATOMIC_RELAXED);
+    if (sizeAndTags & TAG_MMAPPED) {
+        return (char*)mmap_chunk_start(blockInfo) + SIZE(sizeAndTags) - (char*)ptr;
+    }
+    return SIZE(sizeAndTags) - TAG_SIZE;
+}
+
+/*
+ * Allocate a block of at least size bytes like mm_malloc, and store the
+ * number of bytes actually usable in it in *actual, so that growable buffers
+ * can use the whole block.
+ */
+void* mm_malloc_at_least(size_t size, size_t *actual) {
+    void *ptr = mm_malloc(size);
+    *actual = mm_usable_size(ptr);
+    return ptr;
+}
+
+/*
+ * Free the block referenced by ptr, which the caller promises was allocated
+ * for 'size' bytes (the size passed to mm_malloc, the total for mm_calloc, or
+ * anything up to mm_usable_size).
+ * Small blocks go straight to the cache for that size without their header
+ * being read; debug builds check the size against the header.
+ */
+void mm_free_sized(void *ptr, size_t size) {
+    if (ptr == NULL) {
+        return;
+    }
+    // A slab object may have been shrunk in place by mm_realloc, so its class
+    // comes from its page rather than from 'size'
+    if (is_slab(ptr)) {
+        size_t slotSize = slab_page_of(ptr)->size;
+        assert(size != 0 && size <= slotSize);
+        stats_count_frees(1);
+        slab_free(ptr, slab_size_class(slotSize));
+        return;
+    }
+
+    // The block may be up to MIN_BLOCK_SIZE - ALIGNMENT bytes bigger than
+    // asked for (see split_free_block), so it is filed under a bin a little
+    // smaller than its real size, which only wastes that slack.
+    size_t blockSize = adjusted_block_size(size);
+    if (size != 0 && size <= MAX_REQUEST_SIZE && blockSize <= TCACHE_MAX_SIZE) {
+#ifndef NDEBUG
+        block_info *blockInfo = (block_info*)UNSCALED_POINTER_SUB(ptr, TAG_SIZE);
+        size_t sizeAndTags = __atomic_load_n(&blockInfo->size_and_tags, __ATOMIC_RELAXED);
+        assert((sizeAndTags & TAG_USED) && !(sizeAndTags & TAG_MMAPPED));
+        assert(SIZE(sizeAndTags) >= blockSize && SIZE(sizeAndTags) < blockSize + MIN_BLOCK_SIZE);
+#endif
+        stats_count_frees(1);
+        cache_free(ptr, blockSize);
+        return;
+    }
+    mm_free(ptr);
+}
+
+/*
+ * Allocate n blocks of size bytes each, storing pointers to them in ptrs.
+ * The blocks are carved from one free block (or for slab sizes, taken from
+ * the slab) in a single pass. Returns the number of blocks allocated, which
+ * fill the start of ptrs: n, fewer if memory ran out, or 0 if size or n is
+ * zero or size is more than MAX_REQUEST_SIZE.
+ */
+size_t mm_malloc_batch (size_t size, size_t n, void **ptrs) {
+    if (size == 0 || n == 0 || size > MAX_REQUEST_SIZE) {
+        return 0;
+    }
+    size_t count = 0;
+    if (size <= SLAB_MAX_SIZE) {
+        count = slab_alloc(slab_size_class(size), ptrs, n);
+    }
+    if (count < n) {
+        struct arena *arena = thread_arena_lock(tcache_get());
+        count += heap_malloc_batch(size, n - count, ptrs + count);
+        arena_unlock(arena);
+    }
+    stats_count_mallocs(count);
+    return count;
+}
+
+static int compare_addresses(const void *a, const void *b) {
+    uintptr_t x = (uintptr_t)*(void* const*)a;
+    uintptr_t y = (uintptr_t)*(void* const*)b;
+    return (x > y) - (x < y);
+}
+
+/*
+ * Free the n blocks referenced by ptrs (NULLs are skipped). The array is
+ * sorted by address in place, so that blocks that are adjacent in memory are
+ * coalesced into one free block at once and each arena is locked once.
+ */
+void mm_free_batch (void **ptrs, size_t n) {
+    qsort(ptrs, n, sizeof(void*), compare_addresses);
+
+    // Arenas own disjoint address ranges, so each one's blocks form a
+    // contiguous stretch of the sorted array
+    size_t i = 0;
+    while (i < n && ptrs[i] == NULL) {
+        i++;
+    }
+    stats_count_frees(n - i);
+    while (i < n) {
+        // The slab region is contiguous too
+        if (is_slab(ptrs[i])) {
+            size_t end = i + 1;
+            while (end < n && is_slab(ptrs[end])) {
+                end++;
+            }
+            slab_free_objects(ptrs + i, end - i);
+            i = end;
+            continue;
+        }
+        if (is_mmapped_chunk(ptrs[i])) {
+            mmap_chunk_free((block_info*)UNSCALED_POINTER_SUB(ptrs[i], TAG_SIZE));
+            i++;
+            continue;
+        }
+        struct arena *arena = arena_of(ptrs[i]);
+        size_t end = i + 1;
+        while (end < n && arena_of(ptrs[end]) == arena && !is_mmapped_chunk(ptrs[end])) {
+            end++;
+        }
+        arena_lock(arena);
+        heap_free_sorted(ptrs + i, end - i);
+        arena_unlock(arena);
+        i = end;
+    }
+}
+
+/*
+ * Allocate zero-initialized space for nmemb elements of size bytes each.
+ * Returns NULL if the total size is zero, overflows or is more than
+ * MAX_REQUEST_SIZE.
+ */
+void* mm_calloc (size_t nmemb, size_t size) {
+    // Check the multiplication for overflow
+    if (nmemb != 0 && size > (size_t)-1 / nmemb) {
+        return NULL;
+    }
+    size *= nmemb;
+    // A total above MAX_REQUEST_SIZE would wrap in adjusted_block_size
+    if (size == 0 || size > MAX_REQUEST_SIZE) {
+        return NULL;
+    }
+
+    // Cached blocks and slab objects have been used before and need clearing
+    if (adjusted_block_size(size) <= TCACHE_MAX_SIZE) {
+        void *ptr = mm_malloc(size);
+        if (ptr != NULL) {
+            memset(ptr, 0, size);
+        }
+        return ptr;
+    }
+
+    struct arena *arena = thread_arena_lock(tcache_get());
+    void *ptr = heap_calloc(size);
+    arena_unlock(arena);
+    if (ptr != NULL) {
+        stats_count_mallocs(1);
+    }
+    return ptr;
+}
+
+/*
+ * Allocate a block of size bytes whose address is a multiple of alignment,
+ * which must be a power of two. Returns NULL if size is zero or alignment is
+ * not a power of two.
+ */
+void* mm_memalign (size_t alignment, size_t size) {
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+    if (alignment <= ALIGNMENT) {
+        return mm_malloc(size);
+    }
+
+    struct arena *arena = thread_arena_lock(tcache_get());
+    void *ptr = heap_memalign(alignment, size);
+    arena_unlock(arena);
+    if (ptr != NULL) {
+        stats_count_mallocs(1);
+    }
+    return ptr;
+}
+
+/*
+ * POSIX-style aligned allocation: stores the block in *memptr and returns 0,
+ * returns EINVAL if alignment is not a power of two multiple of
+ * sizeof(void*), or ENOMEM if the block can't be allocated. A zero size
+ * stores NULL and returns 0.
+ */
+int mm_posix_memalign (void **memptr, size_t alignment, size_t size) {
+    if (alignment % sizeof(void*) != 0 || (alignment & (alignment - 1)) != 0 || alignment == 0) {
+        return EINVAL;
+    }
+    *memptr = mm_memalign(alignment, size);
+    if (*memptr == NULL && size != 0) {
+        return ENOMEM;
+    }
+    return 0;
+}
+
+/*
+ * C11-style aligned allocation. Returns NULL if alignment is not a power of
+ * two.
+ */
+void* mm_aligned_alloc (size_t alignment, size_t size) {
+    return mm_memalign(alignment, size);
+}
+
+/*
+ * Resize the block referenced by ptr to hold at least size bytes, keeping its
+ * contents up to the smaller of the old and new sizes. Resizes in place when
+ * possible and otherwise moves the block.
+ */
+void* mm_realloc(void *ptr, size_t size) {
+    if(ptr == NULL){
+        return mm_malloc(size);
+    }
+    if(size == 0){
+        mm_free(ptr);
+        return NULL;
+    }
+
+    // Slab objects keep their slot while the new size fits and otherwise move
+    if(is_slab(ptr)){
+        size_t slotSize = slab_page_of(ptr)->size;
+        if(size <= slotSize){
+            return ptr;
+        }
+        void *newPtr = mm_malloc(size);
+        if(newPtr != NULL){
+            memcpy(newPtr, ptr, slotSize);
+            stats_count_frees(1);
+            slab_free(ptr, slab_size_class(slotSize));
+        }
+        return newPtr;
+    }
+
+    // Heap blocks are resized by the arena that owns them; an mmapped chunk
+    // that moves into the heap goes to this thread's arena
+    block_info *blockInfo = (block_info*)UNSCALED_POINTER_SUB(ptr, TAG_SIZE);
+    struct arena *arena;
+    if (__atomic_load_n(&blockInfo->size_and_tags, __ATOMIC_RELAXED) & TAG_MMAPPED) {
+        arena = thread_arena_lock(tcache_get());
+    } else {
+        arena = arena_of(ptr);
+        arena_lock(arena);
+    }
+    void *newPtr = heap_realloc(ptr, size);
+    arena_unlock(arena);
+    return newPtr;
+}
+
+/*
+ * Create a private heap (see HEAPS above). Returns NULL if its region can't
+ * be reserved.
+ */
+mm_heap_t* mm_heap_create() {
+    mm_heap_t *heap = arena_create();
+    if(heap != NULL){
+        heap->is_private = true;
+    }
+    return heap;
+}
+
+/*
+ * Destroy 'heap', releasing everything allocated from it at once. NULL (the
+ * default heap) is left alone.
+ */
+void mm_heap_destroy(mm_heap_t *heap) {
+    if(heap == NULL){
+        return;
+    }
+    pthread_mutex_destroy(&heap->lock);
+    munmap(heap, ARENA_REGION_SIZE);
+}
+
+/*
+ * Allocate a block of size bytes from 'heap', or from the default heap (as
+ * mm_malloc) if 'heap' is NULL. If size is zero, returns NULL. A private
+ * heap never grows past its ARENA_REGION_SIZE region, so this also returns
+ * NULL once the block doesn't fit in what is left of it.
+ */
+void* mm_heap_malloc(mm_heap_t *heap, size_t size) {
+    if(heap == NULL){
+        return mm_malloc(size);
+    }
+    if(size == 0 || size > MAX_REQUEST_SIZE){
+        return NULL;
+    }
+    // Everything comes from the heap's own region, even huge blocks, so that
+    // destroying it releases all of them
+    arena_lock(heap);
+    block_info *block = allocate_block(adjusted_block_size(size));
+    if(block != NULL){
+        heap->malloc_count++;
+    }
+    arena_unlock(heap);
+    return block != NULL ? UNSCALED_POINTER_ADD(block, TAG_SIZE) : NULL;
+}
+
+/*
+ * Free a block allocated with mm_heap_malloc from the same 'heap'.
+ */
+void mm_heap_free(mm_heap_t *heap, void *ptr) {
+    if(heap == NULL){
+        mm_free(ptr);
+        return;
+    }
+    if(ptr == NULL){
+        return;
+    }
+    assert((uintptr_t)ptr - (uintptr_t)heap < ARENA_REGION_SIZE);
+    arena_lock(heap);
+    heap_free(ptr);
+    heap->free_count++;
+    arena_unlock(heap);
+}
+
+// Give the chunks from 'chunk' on back to the heap, batched so that adjacent
+// ones are coalesced once.
+static void region_free_chunks(struct region_chunk* chunk) {
+    void *batch[REGION_FREE_BATCH];
+    size_t n = 0;
+    while(chunk != NULL){
+        batch[n++] = chunk;
+        chunk = chunk->next;
+        if(n == REGION_FREE_BATCH || chunk == NULL){
+            mm_free_batch(batch, n);
+            n = 0;
+        }
+    }
+}
+
+/*
+ * Create an empty region (see REGIONS above). Returns NULL if out of memory.
+ */
+mm_arena_t* mm_arena_create() {
+    mm_arena_t *region = mm_malloc(sizeof(mm_arena_t));
+    if(region != NULL){
+        region->chunks = NULL;
+        region->cur = NULL;
+        region->end = NULL;
+    }
+    return region;
+}
+
+/*
+ * Allocate size bytes, aligned to ALIGNMENT, from 'region'. If size is zero
+ * or the heap has no room for another chunk, returns NULL.
+ */
+void* mm_arena_alloc(mm_arena_t *region, size_t size) {
+    if(size == 0 || size > MAX_REQUEST_SIZE){
+        return NULL;
+    }
+    size = (size + ALIGNMENT - 1) & ~(size_t)(ALIGNMENT - 1);
+    if(size > (size_t)(region->end - region->cur)){
+        // Start a new chunk, big enough for this object
+        size_t chunkSize = size + REGION_HEADER_SIZE;
+        if(chunkSize < REGION_CHUNK_SIZE){
+            chunkSize = REGION_CHUNK_SIZE;
+        }
+        struct region_chunk *chunk = mm_malloc_at_least(chunkSize, &chunkSize);
+        if(chunk == NULL){
+            return NULL;
+        }
+        chunk->next = region->chunks;
+        chunk->size = chunkSize;
+        region->chunks = chunk;
+        region->cur = (char*)chunk + REGION_HEADER_SIZE;
+        region->end = (char*)chunk + chunkSize;
+    }
+    void *ptr = region->cur;
+    region->cur += size;
+    return ptr;
+}
+
+/*
+ * Free every object allocated from 'region' at once. The newest chunk is kept
+ * for the objects to come; the others go back to the heap.
+ */
+void mm_arena_reset(mm_arena_t *region) {
+    struct region_chunk *chunk = region->chunks;
+    if(chunk == NULL){
+        return;
+    }
+    region_free_chunks(chunk->next);
+    chunk->next = NULL;
+    region->cur = (char*)chunk + REGION_HEADER_SIZE;
+    region->end = (char*)chunk + chunk->size;
+}
+
+/*
+ * Free 'region' and every object allocated from it.
+ */
+void mm_arena_destroy(mm_arena_t *region) {
+    if(region == NULL){
+        return;
+    }
+    region_free_chunks(region->chunks);
+    mm_free(region);
+}
+
+// Add 'chunk' to / remove it from the list at 'head'.
+static void pool_list_insert(struct pool_chunk** head, struct pool_chunk* chunk) {
+    chunk->prev = NULL;
+    chunk->next = *head;
+    if(*head != NULL){
+        (*head)->prev = chunk;
+    }
+    *head = chunk;
+}
+
+static void pool_list_remove(struct pool_chunk** head, struct pool_chunk* chunk) {
+    if(chunk->prev != NULL){
+        chunk->prev->next = chunk->next;
+    } else {
+        *head = chunk->next;
+    }
+    if(chunk->next != NULL){
+        chunk->next->prev = chunk->prev;
+    }
+}
+
+/*
+ * Create a pool (see POOLS above) of objects of obj_size bytes, aligned to
+ * 'align', which must be a power of two. Returns NULL if obj_size is zero or
+ * too large, or if out of memory.
+ */
+mm_pool_t* mm_pool_create(size_t obj_size, size_t align) {
+    if(obj_size == 0 || obj_size > MAX_REQUEST_SIZE / POOL_MIN_OBJECTS ||
+       (align & (align - 1)) != 0 || align > MAX_REQUEST_SIZE / POOL_MIN_OBJECTS){
+        return NULL;
+    }
+    // Every object has to be able to hold the free-stack link
+    if(align < ALIGNMENT){
+        align = ALIGNMENT;
+    }
+    mm_pool_t *pool = mm_malloc(sizeof(mm_pool_t));
+    if(pool == NULL){
+        return NULL;
+    }
+    pool->obj_size = (obj_size + align - 1) & ~(align - 1);
+    pool->first_offset = (sizeof(struct pool_chunk) + align - 1) & ~(align - 1);
+    pool->chunk_size = POOL_CHUNK_SIZE;
+    while(pool->chunk_size - pool->first_offset < POOL_MIN_OBJECTS * pool->obj_size){
+        pool->chunk_size *= 2;
+    }
+    pool->chunk_objects = (pool->chunk_size - pool->first_offset) / pool->obj_size;
+    pool->partial = NULL;
+    pool->full = NULL;
+    return pool;
+}
+
+/*
+ * Allocate an object from 'pool'. Returns NULL if out of memory.
+ */
+void* mm_pool_alloc(mm_pool_t *pool) {
+    struct pool_chunk *chunk = pool->partial;
+    if(chunk == NULL){
+        chunk = mm_memalign(pool->chunk_size, pool->chunk_size);
+        if(chunk == NULL){
+            return NULL;
+        }
+        chunk->free = NULL;
+        chunk->unused = (char*)chunk + pool->first_offset;
+        chunk->live = 0;
+        pool_list_insert(&pool->partial, chunk);
+    }
+
+    void *obj = chunk->free;
+    if(obj != NULL){
+        chunk->free = *(void**)obj;
+    } else {
+        obj = chunk->unused;
+        chunk->unused += pool->obj_size;
+    }
+    if(++chunk->live == pool->chunk_objects){
+        pool_list_remove(&pool->partial, chunk);
+        pool_list_insert(&pool->full, chunk);
+    }
+    return obj;
+}
+
+/*
+ * Return an object allocated with mm_pool_alloc to its 'pool'.
+ */
+void mm_pool_free(mm_pool_t *pool, void *ptr) {
+    if(ptr == NULL){
+        return;
+    }
+    struct pool_chunk *chunk = (struct pool_chunk*)((uintptr_t)ptr & ~(uintptr_t)(pool->chunk_size - 1));
+    assert(chunk->live > 0);
+    *(void**)ptr = chunk->free;
+    chunk->free = ptr;
+    if(chunk->live-- == pool->chunk_objects){
+        pool_list_remove(&pool->full, chunk);
+        pool_list_insert(&pool->partial, chunk);
+    }
+}
+
+/*
+ * Give every chunk of 'pool' that has no objects in use back to the heap.
+ * Returns the number of chunks released.
+ */
+size_t mm_pool_trim(mm_pool_t *pool) {
+    size_t released = 0;
+    struct pool_chunk *chunk = pool->partial;
+    while(chunk != NULL){
+        struct pool_chunk *next = chunk->next;
+        if(chunk->live == 0){
+            pool_list_remove(&pool->partial, chunk);
+            mm_free(chunk);
+            released++;
+        }
+        chunk = next;
+    }
+    return released;
+}
+
+/*
+ * Free 'pool' and every object allocated from it.
+ */
+void mm_pool_destroy(mm_pool_t *pool) {
+    if(pool == NULL){
+        return;
+    }
+    struct pool_chunk *lists[] = { pool->partial, pool->full };
+    for(int i = 0; i < 2; i++){
+        struct pool_chunk *chunk = lists[i];
+        while(chunk != NULL){
+            struct pool_chunk *next = chunk->next;
+            mm_free(chunk);
+            chunk = next;
+        }
+    }
+    mm_free(pool);
+}
+
+// Add locked_arena's heap and counters to 'stats': the bytes of its heap, its
+// free blocks (found by walking it), and what it counts under its lock.
+static void arena_add_stats(struct mm_stats *stats) {
+    struct arena *arena = locked_arena;
+    block_info *block = (block_info*)UNSCALED_POINTER_ADD(heap_lo(), HEAP_HEADER_SIZE);
+    size_t size;
+    while((size = SIZE(block->size_and_tags)) != 0){
+        if(!(block->size_and_tags & TAG_USED)){
+            stats->free_blocks++;
+            stats->free_bytes += size;
+            if(size > stats->largest_free_block){
+                stats->largest_free_block = size;
+            }
+        }
+        block = (block_info*)UNSCALED_POINTER_ADD(block, size);
+    }
+    stats->heap_bytes += heap_size();
+    stats->fastbin_bytes += arena->fastbin_bytes;
+    stats->purged_bytes += arena->purged_bytes;
+    stats->realloc_count += arena->realloc_count;
+    stats->realloc_in_place_count += arena->realloc_in_place_count;
+    stats->split_count += arena->split_count;
+    stats->coalesce_count += arena->coalesce_count;
+    stats->sbrk_count += arena->sbrk_count;
+}
+
+/*
+ * Returns statistics on everything but private heaps (see STATISTICS above).
+ * Each arena is locked in turn to walk its heap, so the figures are not a
+ * single snapshot while other threads allocate.
+ */
+struct mm_stats mm_get_stats() {
+    struct mm_stats stats;
+    memset(&stats, 0, sizeof(stats));
+    stats_flush_thread(&thread_cache);
+
+    unsigned int count = __atomic_load_n(&num_arenas, __ATOMIC_ACQUIRE);
+    for(unsigned int i = 0; i < count; i++){
+        struct arena *arena = arenas[i];
+        arena_lock(arena);
+        // Publish what the arena hasn't yet, so the bytes in use are exact
+        stats_add_in_use(arena->in_use_bytes - arena->published_bytes);
+        arena->published_bytes = arena->in_use_bytes;
+        arena_add_stats(&stats);
+        arena_unlock(arena);
+    }
+
+    stats.in_use_bytes = __atomic_load_n(&stats_in_use_bytes, __ATOMIC_RELAXED);
+    stats.peak_in_use_bytes = __atomic_load_n(&stats_peak_bytes, __ATOMIC_RELAXED);
+    stats.mmapped_bytes = __atomic_load_n(&stats_mmapped_bytes, __ATOMIC_RELAXED);
+    stats.slab_bytes = __atomic_load_n(&stats_slab_bytes, __ATOMIC_RELAXED);
+    stats.malloc_count = __atomic_load_n(&stats_malloc_count, __ATOMIC_RELAXED);
+    stats.free_count = __atomic_load_n(&stats_free_count, __ATOMIC_RELAXED);
+    return stats;
+}
+
+/*
+ * Returns statistics on the private heap 'heap' alone, or mm_get_stats() if
+ * 'heap' is NULL. A private heap has no caches, slabs or mmap chunks, so
+ * those figures are zero, and its counters are exact.
+ */
+struct mm_stats mm_heap_get_stats(mm_heap_t *heap) {
+    if(heap == NULL){
+        return mm_get_stats();
+    }
+    struct mm_stats stats;
+    memset(&stats, 0, sizeof(stats));
+    arena_lock(heap);
+    arena_add_stats(&stats);
+    stats.in_use_bytes = heap->in_use_bytes;
+    stats.peak_in_use_bytes = heap->peak_bytes;
+    stats.malloc_count = heap->malloc_count;
+    stats.free_count = heap->free_count;
+    arena_unlock(heap);
+    return stats;
+}
+
+// HEAP CHECKER -----------------------------------------------------
+
+// Report an inconsistency found by mm_check at 'where'.
+static void check_error(const void* where, const char* problem) {
+  fprintf(stderr, "mm_check: %p: %s\n", where, problem);
+}
+
+// Returns true if 'block' lies in locked_arena's heap, before the
+// end-of-heap word, and has an aligned payload, so its header can be read.
+static bool check_in_heap(block_info* block) {
+  void* first = UNSCALED_POINTER_ADD(heap_lo(), HEAP_HEADER_SIZE);
+  void* end_of_heap = UNSCALED_POINTER_SUB(heap_hi(), TAG_SIZE - 1);
+  return (void*) block >= first && (void*) block < end_of_heap &&
+         (uintptr_t) UNSCALED_POINTER_ADD(block, TAG_SIZE) % ALIGNMENT == 0;
+}
+
+// Returns true if every byte of the free block 'block' that TAG_ZEROED
+// promises is zero (all but its header, next/prev links and footer) is.
+static bool check_zeroed(block_info* block, size_t size) {
+  unsigned char* bytes = (unsigned char*) block;
+  for (size_t i = sizeof(block_info); i < size - TAG_SIZE; i++) {
+    if (bytes[i] != 0) {
+      return false;
+    }
+  }
+  return true;
+}
+
+/*
+ * Walk locked_arena's heap block by block, checking sizes, alignment, the
+ * TAG_PRECEDING_USED bits, free blocks' footers and contents, that no two
+ * free blocks are adjacent, and the end-of-heap word. Counts the free blocks
+ * in *free_blocks. Returns the number of problems found.
+ */
+static int check_blocks(size_t* free_blocks) {
+  int errors = 0;
+  tag_t* end_of_heap = (tag_t*) UNSCALED_POINTER_SUB(heap_hi(), TAG_SIZE - 1);
+  block_info* block = (block_info*) UNSCALED_POINTER_ADD(heap_lo(), HEAP_HEADER_SIZE);
+  bool preceding_used = true;
+
+  while ((tag_t*) block < end_of_heap) {
+    size_t tags = block->size_and_tags;
+    size_t size = SIZE(tags);
+    // Past a bad size the walk can't go on
+    if (size < MIN_BLOCK_SIZE || size % ALIGNMENT != 0 ||
+        size > (size_t) ((char*) end_of_heap - (char*) block)) {
+      check_error(block, "bad block size");
+      return errors + 1;
+    }
+    if (!(tags & TAG_PRECEDING_USED) != !preceding_used) {
+      check_error(block, "TAG_PRECEDING_USED doesn't match the preceding block");
+      errors++;
+    }
+    if (tags & TAG_USED) {
+      // In a used block that bit is TAG_MMAPPED, which heap blocks never have
+      if (tags & TAG_MMAPPED) {
+        check_error(block, "heap block is tagged TAG_MMAPPED");
+        errors++;
+      }
+    } else {
+      if (!preceding_used) {
+        check_error(block, "free block follows another free block");
+        errors++;
+      }
+      if (*(tag_t*) UNSCALED_POINTER_ADD(block, size - TAG_SIZE) != tags) {
+        check_error(block, "free block's footer doesn't match its header");
+        errors++;
+      }
+      if ((tags & TAG_ZEROED) && !check_zeroed(block, size)) {
+        check_error(block, "TAG_ZEROED block isn't zero");
+        errors++;
+      }
+      (*free_blocks)++;
+    }
+    preceding_used = tags & TAG_USED;
+    block = (block_info*) UNSCALED_POINTER_ADD(block, size);
+  }
+
+  if (SIZE(*end_of_heap) != 0 || !(*end_of_heap & TAG_USED) ||
+      !(*end_of_heap & TAG_PRECEDING_USED) != !preceding_used) {
+    check_error(end_of_heap, "bad end-of-heap word");
+    errors++;
+  }
+  return errors;
+}
+
+#if FIT_POLICY == FIT_SEGREGATED
+/*
+ * Walk the best-fit tree in key order, each node found as the successor of
+ * the last by a search from the root, so the tree isn't changed and no stack
+ * is needed. Every node must be a free block big enough for the tree; one
+ * out of order is skipped by the searches and so shows up in the count.
+ * Gives up after 'limit' nodes. Returns the number of nodes, adding the
+ * problems found to *errors.
+ */
+static size_t check_tree(size_t limit, int* errors) {
+  size_t count = 0;
+  size_t size = 0;
+  block_info* last = NULL;
+  while (true) {
+    block_info* next = NULL;
+    block_info* node = FREE_INDEX->tree_root;
+    for (size_t depth = 0; node != NULL; depth++) {
+      if (depth > limit || !check_in_heap(node) || (node->size_and_tags & TAG_USED) ||
+          SIZE(node->size_and_tags) < TREE_MIN_SIZE) {
+        check_error(node, "best-fit tree holds a block that isn't a big free block");
+        (*errors)++;
+        return count;
+      }
+      if (tree_key_less(size, last, node)) {
+        next = node;
+        node = from_link(node->left);
+      } else {
+        node = from_link(node->right);
+      }
+    }
+    if (next == NULL || ++count > limit) {
+      return count;
+    }
+    size = SIZE(next->size_and_tags);
+    last = next;
+  }
+}
+#endif
+
+/*
+ * Check that locked_arena's free index holds exactly its 'free_blocks' free
+ * blocks, each in the list (or tree) for its size class, with consistent
+ * prev links (and TLSF bitmaps). Returns the number of problems found.
+ */
+static int check_free_index(size_t free_blocks) {
+  int errors = 0;
+  size_t listed = 0;
+
+  for (int class = 0; class < NUM_SIZE_CLASSES; class++) {
+    block_info* prev = NULL;
+    for (block_info* block = FREE_LIST_HEAD(class); block != NULL;
+         block = from_link(block->next)) {
+      if (!check_in_heap(block) || (block->size_and_tags & TAG_USED)) {
+        check_error(block, "free list holds a block that isn't free");
+        errors++;
+        break;
+      }
+      // More blocks than the heap has free means a cycle, or a block listed
+      // twice; the count below reports it.
+      if (++listed > free_blocks) {
+        break;
+      }
+      if (size_class(SIZE(block->size_and_tags)) != class) {
+        check_error(block, "free block is in the wrong list for its size");
+        errors++;
+      }
+      if (from_link(block->prev) != prev) {
+        check_error(block, "free block's prev link is wrong");
+        errors++;
+      }
+      prev = block;
+    }
+#if FIT_POLICY == FIT_TLSF
+    bool marked = FREE_INDEX->sl_bitmap[class / TLSF_SL_COUNT] &
+                  ((uint32_t) 1 << (class % TLSF_SL_COUNT));
+    if (marked != (FREE_LIST_HEAD(class) != NULL)) {
+      check_error(heap_lo(), "sl_bitmap doesn't match the free lists");
+      errors++;
+    }
+#endif
+  }
+#if FIT_POLICY == FIT_TLSF
+  for (int fl = 0; fl < TLSF_FL_COUNT; fl++) {
+    if (!((FREE_INDEX->fl_bitmap >> fl) & 1) != (FREE_INDEX->sl_bitmap[fl] == 0)) {
+      check_error(heap_lo(), "fl_bitmap doesn't match sl_bitmap");
+      errors++;
+    }
+  }
+#else
+  listed += check_tree(free_blocks, &errors);
+#endif
+
+  if (listed != free_blocks) {
+    check_error(heap_lo(), "free index doesn't hold every free block exactly once");
+    errors++;
+  }
+  return errors;
+}
+
+// Check that locked_arena's fast bins hold used heap blocks of their bins'
+// sizes, adding up to fastbin_bytes. Returns the number of problems found.
+static int check_fastbins() {
+  struct arena* arena = locked_arena;
+  int errors = 0;
+  size_t bytes = 0;
+  for (size_t bin = 0; bin < NUM_FASTBINS; bin++) {
+    size_t size = MIN_BLOCK_SIZE + bin * ALIGNMENT;
+    for (void* payload = arena->fastbins[bin]; payload != NULL; payload = *(void**) payload) {
+      block_info* block = (block_info*) UNSCALED_POINTER_SUB(payload, TAG_SIZE);
+      if (!check_in_heap(block) || !(block->size_and_tags & TAG_USED) ||
+          (block->size_and_tags & TAG_MMAPPED) || SIZE(block->size_and_tags) != size) {
+        check_error(block, "fast bin holds a block that isn't a used block of its size");
+        errors++;
+        break;
+      }
+      // Stop a cycle; the total below reports it
+      bytes += size;
+      if (bytes > arena->fastbin_bytes) {
+        break;
+      }
+    }
+  }
+  if (bytes != arena->fastbin_bytes) {
+    check_error(arena, "fast bins don't add up to fastbin_bytes");
+    errors++;
+  }
+  return errors;
+}
+
+/*
+ * A heap consistency checker. Locks each arena in turn and checks its heap's
+ * blocks, free index and fast bins (private heaps are not checked). Prints
+ * each problem to stderr. Returns nonzero if no problem was found and 0
+ * otherwise.
+ */
+int mm_check() {
+  int errors = 0;
+  unsigned int count = __atomic_load_n(&num_arenas, __ATOMIC_ACQUIRE);
+  for (unsigned int i = 0; i < count; i++) {
+    arena_lock(arenas[i]);
+    size_t free_blocks = 0;
+    errors += check_blocks(&free_blocks);
+    errors += check_free_index(free_blocks);
+    errors += check_fastbins();
+    arena_unlock(arenas[i]);
+  }
+  return errors == 0;
 }
@@ -0,0 +1,89 @@
+/*
+ * Extensions to the lab's allocator interface in mm.h. See the notes at the
+ * top of the allocator's source and the comment on each function there.
+ */
+#ifndef MM_EXT_H
+#define MM_EXT_H
+
+#include <stddef.h>
+
+// The standard allocation calls.
+void* mm_realloc(void* ptr, size_t size);
+void* mm_calloc(size_t nmemb, size_t size);
+void* mm_memalign(size_t alignment, size_t size);
+int mm_posix_memalign(void** memptr, size_t alignment, size_t size);
+void* mm_aligned_alloc(size_t alignment, size_t size);
+
+// Giving free memory back to the system.
+int mm_trim(size_t pad);
+size_t mm_purge(long decay_ms);
+void mm_set_purge_decay(long decay_ms);
+size_t mm_purged_bytes(void);
+
+// How the heap grows.
+void mm_set_growth_policy(size_t minChunk, size_t percent, size_t maxChunk);
+
+// Variants of mm_malloc and mm_free.
+size_t mm_malloc_batch(size_t size, size_t n, void** ptrs);
+void mm_free_batch(void** ptrs, size_t n);
+void mm_free_sized(void* ptr, size_t size);
+size_t mm_usable_size(void* ptr);
+void* mm_malloc_at_least(size_t size, size_t* actual);
+
+// Private heaps (see HEAPS), which are opaque to their users.
+typedef struct arena mm_heap_t;
+mm_heap_t* mm_heap_create(void);
+void mm_heap_destroy(mm_heap_t* heap);
+void* mm_heap_malloc(mm_heap_t* heap, size_t size);
+void mm_heap_free(mm_heap_t* heap, void* ptr);
+
+// Regions (see REGIONS), which are opaque to their users.
+typedef struct region mm_arena_t;
+mm_arena_t* mm_arena_create(void);
+void* mm_arena_alloc(mm_arena_t* region, size_t size);
+void mm_arena_reset(mm_arena_t* region);
+void mm_arena_destroy(mm_arena_t* region);
+
+// Pools of fixed-size objects (see POOLS), which are opaque to their users.
+typedef struct pool mm_pool_t;
+mm_pool_t* mm_pool_create(size_t obj_size, size_t align);
+void* mm_pool_alloc(mm_pool_t* pool);
+void mm_pool_free(mm_pool_t* pool, void* ptr);
+size_t mm_pool_trim(mm_pool_t* pool);
+void mm_pool_destroy(mm_pool_t* pool);
+
+// Allocator statistics, as returned by mm_get_stats (see STATISTICS).
+struct mm_stats {
+  // Bytes in used blocks, mmapped chunks and slab pages, now and at most.
+  size_t in_use_bytes;
+  size_t peak_in_use_bytes;
+  // Size of the arenas' heaps, and bytes in mmapped chunks and slab pages.
+  size_t heap_bytes;
+  size_t mmapped_bytes;
+  size_t slab_bytes;
+  // Free blocks in the heaps: how many, their total size and the largest.
+  size_t free_blocks;
+  size_t free_bytes;
+  size_t largest_free_block;
+  // Bytes in blocks waiting in the fast bins, and released by purging.
+  size_t fastbin_bytes;
+  size_t purged_bytes;
+  // Operation counts.
+  size_t malloc_count;
+  size_t free_count;
+  size_t realloc_count;
+  size_t realloc_in_place_count;
+  size_t split_count;
+  size_t coalesce_count;
+  size_t sbrk_count;
+};
+
+// Statistics.
+void mm_realloc_counts(size_t* calls, size_t* inPlace);
+struct mm_stats mm_get_stats(void);
+struct mm_stats mm_heap_get_stats(mm_heap_t* heap);
+
+// The heap consistency checker.
+int mm_check(void);
+
+#endif // MM_EXT_H